@@ -99,20 +99,19 @@ int main(int argc, char ** argv) {
         uint32_t background = scene[i].background;
         glm::dvec3 position = scene[i].position * SCALE;
         glm::dmat3 orientation = scene[i].orientation;
+        octree_set_background(true, background);
 
         // Run tests
         double times[N];
         for (int j=-1; j<N; j++) {
             Timer t;
 #ifdef SSAA_TEST
-            ssaa.clear(background);
             octree_draw(&in, ssaa, get_view_pane(), position, orientation);
             Timer tt;
             filter.apply(ssaa);
             printf("SSAO: %lf\n", tt.elapsed());
             surf.copy(ssaa);
 #else
-            surf.clear(background);
             octree_draw(&in, surf, get_view_pane(), position, orientation);
 #endif
             flip_screen();
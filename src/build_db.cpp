@@ -22,14 +22,20 @@
 #include <cassert>
 #include <ctime>
 #include <algorithm>
+#include <string>
+#include <vector>
+#include <queue>
+#include <thread>
 #include <fcntl.h>
 #include <unistd.h>
 #include <sys/mman.h>
 #include <errno.h>
+#include <immintrin.h>
 
 #include "pointset.h"
 #include "timing.h"
 #include "octree.h"
+#include "threadpool.h"
 
 // For outputing the elapsed time.
 static Timer t;
@@ -66,7 +72,7 @@ static const uint64_t B[] = {
 };
 static const uint64_t S[] = {32, 16, 8, 4, 2};
     
-uint64_t morton3d( uint64_t x, uint64_t y, uint64_t z ) {   
+static uint64_t morton3d_generic( uint64_t x, uint64_t y, uint64_t z ) {   
   // pack 3 32-bit indices into a 96-bit Morton code
   // except that the result is truncated to 64-bit.
   for (uint64_t i=0; i<5; i++) {
@@ -77,52 +83,135 @@ uint64_t morton3d( uint64_t x, uint64_t y, uint64_t z ) {
   return x | (y<<1) | (z<<2);
 }
 
+/** Deposits the bits of each coordinate directly, which is equal to morton3d_generic for coordinates below 2^21. */
+__attribute__((target("bmi2")))
+static uint64_t morton3d_bmi2( uint64_t x, uint64_t y, uint64_t z ) {
+  return _pdep_u64(x, 0x9249249249249249) | _pdep_u64(y, 0x2492492492492492) | _pdep_u64(z, 0x4924924924924924);
+}
+
+/** Returns whether pdep is available and fast. AMD cpus before Zen 3 implement it in microcode. */
+static bool fast_bmi2() {
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("bmi2") && !__builtin_cpu_is("bdver4") && !__builtin_cpu_is("znver1") && !__builtin_cpu_is("znver2");
+}
+
+static uint64_t (*const morton3d)( uint64_t x, uint64_t y, uint64_t z ) = fast_bmi2() ? morton3d_bmi2 : morton3d_generic;
+
+/** Computes a single level of the Hilbert curve.
+ * @param state the orientation of the curve within the current node, being start | end<<3, 
+ *        where start and end are the octants in which the curve enters and leaves the node.
+ * @param octant the octant of the current node that contains the point.
+ * @param digit is set to the position of that octant along the curve.
+ * @return the orientation of the curve within that octant. */
+static uint64_t hilbert3d_step( uint64_t state, uint64_t octant, uint64_t & digit ) {
+  uint64_t start = state & 7;
+  uint64_t end = state >> 3; // can be start^1, start^2 or start^4
+  uint64_t rg = octant ^ start;
+  uint64_t travel_shift = (0x30210 >> (start ^ end)*4)&3;
+  uint64_t i = (((rg << 3) | rg) >> travel_shift ) & 7;
+  i = (0x54672310 >> i*4) & 7;
+  digit = i;
+  uint64_t si = (0x64422000 >> i*4 ) & 7; // next lower even number, or 0
+  uint64_t ei = (0x77755331 >> i*4 ) & 7; // next higher odd number, or 7
+  uint64_t sg = ( si ^ (si>>1) ) << travel_shift;
+  uint64_t eg = ( ei ^ (ei>>1) ) << travel_shift;
+  end   = ( ( eg | ( eg >> 3 ) ) & 7 ) ^ start;
+  start = ( ( sg | ( sg >> 3 ) ) & 7 ) ^ start;
+  return start | end << 3;
+}
+
+/** Lookup table that computes two levels of the Hilbert curve at once. 
+ * It is indexed by state<<6 | two octants, and contains the next state<<6 | two digits. */
+static struct hilbert3d_table {
+  uint32_t next[64*64];
+  hilbert3d_table() {
+    for (uint64_t state = 0; state < 64; state++) {
+      for (uint64_t octants = 0; octants < 64; octants++) {
+        uint64_t d1, d2;
+        uint64_t s = hilbert3d_step(hilbert3d_step(state, octants >> 3, d1), octants & 7, d2);
+        next[state << 6 | octants] = s << 6 | d1 << 3 | d2;
+      }
+    }
+  }
+} HILBERT;
+
+/** The state in which the Hilbert curve starts, with start=0 and end=1. */
+static const uint64_t HILBERT_START = 1 << 3;
+
+/** Returns the position of the point along a 60 bit Hilbert curve. */
 uint64_t hilbert3d( const point & p ) {
   uint64_t val = morton3d( p.x,p.y,p.z );
-  uint64_t start = 0;
-  uint64_t end = 1; // can be 1,2,4
+  uint64_t state = HILBERT_START;
   uint64_t ret = 0;
-  for (int64_t j=19; j>=0; j--) {
-    uint64_t rg = ((val>>(3*j))&7) ^ start;
-    uint64_t travel_shift = (0x30210 >> (start ^ end)*4)&3;
-    uint64_t i = (((rg << 3) | rg) >> travel_shift ) & 7;
-    i = (0x54672310 >> i*4) & 7;
-    ret = (ret<<3) | i;
-    uint64_t si = (0x64422000 >> i*4 ) & 7; // next lower even number, or 0
-    uint64_t ei = (0x77755331 >> i*4 ) & 7; // next higher odd number, or 7
-    uint64_t sg = ( si ^ (si>>1) ) << travel_shift;
-    uint64_t eg = ( ei ^ (ei>>1) ) << travel_shift;
-    end   = ( ( eg | ( eg >> 3 ) ) & 7 ) ^ start;
-    start = ( ( sg | ( sg >> 3 ) ) & 7 ) ^ start;
+  for (int j=54; j>=0; j-=6) {
+    uint64_t e = HILBERT.next[state << 6 | ((val >> j) & 63)];
+    ret = (ret << 6) | (e & 63);
+    state = e >> 6;
   }
   return ret;
 }
-    
-bool hilbert3d_compare( const point & p1,const point & p2 ) {
-  uint64_t val1 = morton3d( p1.x,p1.y,p1.z );
-  uint64_t val2 = morton3d( p2.x,p2.y,p2.z );
-  uint64_t start = 0;
-  uint64_t end = 1; // can be 1,2,4
-  for (int64_t j=19; j>=0; j--) {
-    uint64_t travel_shift = (0x30210 >> (start ^ end)*4)&3;
-    uint64_t rg1 = ((val1>>(3*j))&7) ^ start;
-    uint64_t rg2 = ((val2>>(3*j))&7) ^ start;
-    uint64_t i1 = (((rg1 << 3) | rg1) >> travel_shift ) & 7;
-    uint64_t i2 = (((rg2 << 3) | rg2) >> travel_shift ) & 7;
-    i1 = (0x54672310 >> i1*4) & 7;
-    i2 = (0x54672310 >> i2*4) & 7;
-    if (i1<i2) return true;
-    if (i1>i2) return false;
-    uint64_t si = (0x64422000 >> i1*4 ) & 7; // next lower even number, or 0
-    uint64_t ei = (0x77755331 >> i1*4 ) & 7; // next higher odd number, or 7
-    uint64_t sg = ( si ^ (si>>1) ) << travel_shift;
-    uint64_t eg = ( ei ^ (ei>>1) ) << travel_shift;
-    end   = ( ( eg | ( eg >> 3 ) ) & 7 ) ^ start;
-    start = ( ( sg | ( sg >> 3 ) ) & 7 ) ^ start;
-  }
-  return false;
+
+static void hilbert3d_generic( const point * p, uint64_t n, uint64_t * keys ) {
+  for (uint64_t i=0; i<n; i++) keys[i] = hilbert3d(p[i]);
 }
 
+/** Spreads the bits of 8 coordinates for morton3d. 
+ * The masked forms of the intrinsics are used, as the unmasked ones raise uninitialized warnings in gcc. */
+__attribute__((target("avx512f")))
+static inline __m512i morton3d_spread( __m512i x ) {
+  for (int i=0; i<5; i++) {
+    x = _mm512_and_si512(_mm512_or_si512(x, _mm512_maskz_slli_epi64(0xff, x, S[i])), _mm512_set1_epi64(B[i]));
+  }
+  return x;
+}
+
+/** Computes the Hilbert keys of 8 points at a time, using gathers for the table lookups. */
+__attribute__((target("avx512f")))
+static void hilbert3d_avx512( const point * p, uint64_t n, uint64_t * keys ) {
+  // Selects the x coordinates of 8 points, placing them in the even 32 bit lanes.
+  const __m512i X = _mm512_set_epi32(0,28, 0,24, 0,20, 0,16, 0,12, 0,8, 0,4, 0,0);
+  const __m512i one = _mm512_set1_epi32(1);
+  const __m512i mask = _mm512_set1_epi64(63);
+  uint64_t i = 0;
+  for (; i+8<=n; i+=8) {
+    // Transpose the coordinates of 8 points into 8 lanes of 64 bits.
+    __m512i a = _mm512_loadu_si512(p + i);
+    __m512i b = _mm512_loadu_si512(p + i + 4);
+    __m512i x = _mm512_maskz_permutex2var_epi32(0x5555, a, X, b);
+    __m512i y = _mm512_maskz_permutex2var_epi32(0x5555, a, _mm512_add_epi32(X, one), b);
+    __m512i z = _mm512_maskz_permutex2var_epi32(0x5555, a, _mm512_add_epi32(X, _mm512_add_epi32(one, one)), b);
+    x = morton3d_spread(x);
+    y = _mm512_maskz_slli_epi64(0xff, morton3d_spread(y), 1);
+    z = _mm512_maskz_slli_epi64(0xff, morton3d_spread(z), 2);
+    __m512i val = _mm512_or_si512(x, _mm512_or_si512(y, z));
+    __m512i state = _mm512_set1_epi64(HILBERT_START);
+    __m512i ret = _mm512_setzero_si512();
+    for (int j=54; j>=0; j-=6) {
+      __m512i octants = _mm512_and_si512(_mm512_maskz_srli_epi64(0xff, val, j), mask);
+      __m512i index = _mm512_or_si512(_mm512_maskz_slli_epi64(0xff, state, 6), octants);
+      __m256i next = _mm512_mask_i64gather_epi32(_mm256_setzero_si256(), 0xff, index, HILBERT.next, 4);
+      __m512i e = _mm512_maskz_cvtepu32_epi64(0xff, next);
+      ret = _mm512_or_si512(_mm512_maskz_slli_epi64(0xff, ret, 6), _mm512_and_si512(e, mask));
+      state = _mm512_maskz_srli_epi64(0xff, e, 6);
+    }
+    _mm512_storeu_si512(keys + i, ret);
+  }
+  hilbert3d_generic(p + i, n - i, keys + i);
+}
+
+typedef void (*hilbert3d_function)( const point * p, uint64_t n, uint64_t * keys );
+
+static hilbert3d_function select_hilbert3d() {
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("avx512f") ? hilbert3d_avx512 : hilbert3d_generic;
+}
+
+/** Computes the Hilbert keys of the n given points, using the widest instruction set supported by the cpu. */
+static const hilbert3d_function hilbert3d_batch = select_hilbert3d();
+
+/** The number of keys that are computed at once by the callers of hilbert3d_batch. */
+static const uint64_t HILBERT_BATCH = 256;
+    
 #define CLAMP(x,l,u) (x<l?l:x>u?u:x)
 uint32_t rgb(int32_t r, int32_t g, int32_t b) {
   return (CLAMP(r,0,255)<<16)|(CLAMP(g,0,255)<<8)|(CLAMP(b,0,255));
@@ -155,8 +244,9 @@ struct weighted_color {
   }
 };
 // Note: recursive function, assumes that the octree is indeed a tree.
-weighted_color average(octree* root, uint32_t index) {
-  octree &node = root[index];
+template<class octree_node>
+weighted_color average(octree_node* root, uint64_t index) {
+  octree_node &node = root[index];
   int n = node.size();
   assert(n>0);
   weighted_color c;
@@ -168,10 +258,11 @@ weighted_color average(octree* root, uint32_t index) {
 }
 
 static uint32_t mask2bitmask[]={0x01,0x03,0x05,0x0f,0x11,0x33,0x55,0xff};
-void replicate(octree* root, int index, uint32_t mask, uint32_t depth) {
+template<class octree_node>
+void replicate(octree_node* root, uint64_t index, uint32_t mask, uint32_t depth) {
   mask = mask2bitmask[mask];
   for (uint32_t i=0; i<depth; i++) {
-    octree &node = root[index];
+    octree_node &node = root[index];
     node.bitmask = mask;
     for (uint32_t i=1; i<8; i++) {
       node.child[i] = node.child[0];
@@ -185,20 +276,58 @@ struct arguments {
   const char * outfile;
   int repeat_mask;
   int repeat_depth;
+  bool wide; //< Whether the octree must be written in the wide format, even if it would fit in an .oc2 file.
+  octree_format encoding; //< The format into which the octree is encoded after building it, if it is compact or split.
+  bool stream; //< Whether the points are read sequentially and distributed over shards, instead of being sorted in place.
+  int threads; //< Number of threads used for sorting and for building the octree.
+  uint64_t memory; //< Number of bytes of memory that may be used for sorting and for distributing points over shards.
 };
 
 arguments parse_arguments(int argc, char ** argv) {
-  static const int ARG_INFILE = 1;
-  static const int ARG_OUTFILE = 2;
-  static const int ARG_REPEAT_MASK = 3;
-  static const int ARG_REPEAT_DEPTH = 4;
   arguments r;
   r.repeat_mask = 7;
   r.repeat_depth = 0;
+  r.wide = false;
+  r.encoding = OCTREE_FORMAT_OC2;
+  r.stream = false;
+  r.threads = std::max(1u, std::thread::hardware_concurrency());
+  r.memory = uint64_t(1024) << 20;
+
+  // Options precede the positional arguments.
+  int options = 1;
+  for (; options < argc && argv[options][0] == '-' && argv[options][1] != 0; options++) {
+    if (strcmp(argv[options], "-wide") == 0) {
+      r.wide = true;
+    } else if (strcmp(argv[options], "-compact") == 0) {
+      r.encoding = OCTREE_FORMAT_COMPACT;
+    } else if (strcmp(argv[options], "-split") == 0) {
+      r.encoding = OCTREE_FORMAT_SPLIT;
+    } else if (strcmp(argv[options], "-stream") == 0) {
+      r.stream = true;
+    } else if (strcmp(argv[options], "-threads") == 0 && options+1 < argc && atoi(argv[options+1]) > 0) {
+      r.threads = atoi(argv[++options]);
+    } else if (strcmp(argv[options], "-memory") == 0 && options+1 < argc && atoi(argv[options+1]) > 0) {
+      r.memory = uint64_t(atoi(argv[++options])) << 20;
+    } else {
+      argc = 0; // Unknown option, show usage.
+      break;
+    }
+  }
+  const int ARG_INFILE = options;
+  const int ARG_OUTFILE = options + 1;
+  const int ARG_REPEAT_MASK = options + 2;
+  const int ARG_REPEAT_DEPTH = options + 3;
 
-  if (argc != 3 && argc != 5) {
-    fprintf(stderr,"Usage: %s input_file output_file [repeat_mask repeat_depth]\n", argv[0]);
+  if (argc - options != 2 && argc - options != 4) {
+    fprintf(stderr,"Usage: %s [-wide] [-compact|-split] [-stream] [-threads n] [-memory MiB] input_file output_file [repeat_mask repeat_depth]\n", argv[0]);
     fprintf(stderr,"Converts a poinlist (*.vxl) into an octree (*.oc2).\n");
+    fprintf(stderr,"Octrees that are too large for the .oc2 format, or if -wide is given, are written in the wide format.\n");
+    fprintf(stderr,"If -compact is given, the octree is written in the compact format, which uses 16 bit child offsets.\n");
+    fprintf(stderr,"If -split is given, the octree is written in the split format, which stores the colors separately.\n");
+    fprintf(stderr,"If -stream is given, the input file, which can be - for stdin, is read once and not modified.\n");
+    fprintf(stderr,"The points are sorted in shards on disk instead, using the given amount of memory.\n");
+    fprintf(stderr,"The octree is built using the given number of threads (default: all cores).\n");
+    fprintf(stderr,"Unsorted points are sorted using these threads and the given amount of memory (default: 1024 MiB).\n");
     exit(2);
   }
 
@@ -210,7 +339,7 @@ arguments parse_arguments(int argc, char ** argv) {
   printf("[%10.0f] Conversion of pointfile %s into octree %s started at %d:%02d:%02d.\n", t.elapsed(), r.infile, r.outfile, timeinfo->tm_hour, timeinfo->tm_min, timeinfo->tm_sec);
 
   // Determine repeat arguments
-  if (argc == 5) {
+  if (argc - options == 4) {
     char * endptr = NULL;
     r.repeat_mask  = strtol(argv[ARG_REPEAT_MASK], &endptr, 10);
     if (errno) {perror("Could not parse mask"); exit(1);}
@@ -229,9 +358,227 @@ arguments parse_arguments(int argc, char ** argv) {
   return r;
 }
 
-void hilbert_sort_points(const arguments &arg, pointset &in) {
+/** A point with its position on the Hilbert curve, which is used to sort the points. */
+struct keyed_point {
+  uint64_t key;
+  point p;
+  bool operator<(const keyed_point & other) const { return key < other.key; }
+};
+
+/** Writes the given number of bytes to the given file at the given offset. */
+static void write_fully(int fd, const void * data, uint64_t size, uint64_t offset) {
+  const char * bytes = (const char *)data;
+  while (size > 0) {
+    ssize_t r = pwrite(fd, bytes, size, offset);
+    if (r <= 0) {perror("Could not write sorted points"); exit(1);}
+    bytes += r;
+    size -= r;
+    offset += r;
+  }
+}
+
+/** Reads the given number of bytes from the given file at the given offset. */
+static void read_fully(int fd, void * data, uint64_t size, uint64_t offset) {
+  char * bytes = (char *)data;
+  while (size > 0) {
+    ssize_t r = pread(fd, bytes, size, offset);
+    if (r <= 0) {perror("Could not read sorted points"); exit(1);}
+    bytes += r;
+    size -= r;
+    offset += r;
+  }
+}
+
+/** A sorted sequence of points in the run file, which is read in blocks during the merge. */
+struct sorted_run {
+  uint64_t next;  //< Position in the run file of the next point that is not buffered yet.
+  uint64_t end;   //< Position in the run file of the end of the run.
+  std::vector<point> buffer;
+  size_t pos;     //< Position in the buffer of the first point that is not merged yet.
+  /** Reads the next block of the run into the buffer. @return false if the run has been merged completely. */
+  bool fill(int fd, uint64_t block) {
+    uint64_t n = std::min(block, end - next);
+    buffer.resize(n);
+    read_fully(fd, buffer.data(), n * sizeof(point), next * sizeof(point));
+    next += n;
+    pos = 0;
+    return n > 0;
+  }
+};
+
+/** Sorts the points along the Hilbert curve, using external memory to stay within the memory budget.
+ * The points are split in chunks that fit in memory. Each chunk is sorted in pieces, 
+ * one per thread, using precomputed keys, and each piece is written to a temporary run file as a sorted run. 
+ * The runs are then merged into the point file, reading and writing blocks of points. */
+void external_sort(const arguments &arg, threadpool &pool, pointset &in) {
+  std::string filename = std::string(arg.outfile) + ".runs";
+  int fd = open(filename.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600);
+  if (fd == -1) {perror("Could not create temporary run file"); exit(1);}
+  unlink(filename.c_str()); // The file is removed when it is closed.
+  
+  // Create the sorted runs.
+  uint64_t chunk = std::max<uint64_t>(arg.memory / sizeof(keyed_point), pool.size());
+  std::vector<keyed_point> sorted(std::min(chunk, in.length));
+  std::vector<uint64_t> runs; //< Boundaries of the runs in the run file.
+  runs.push_back(0);
+  for (uint64_t start = 0; start < in.length; start += chunk) {
+    uint64_t length = std::min(chunk, in.length - start);
+    printf("[%10.0f] Sorting points %lu to %lu.\n", t.elapsed(), start, start + length);
+    uint64_t piece = (length + pool.size() - 1) / pool.size();
+    pool.run(pool.size(), [&](int i) {
+      uint64_t begin = std::min(i * piece, length);
+      uint64_t end = std::min(begin + piece, length);
+      uint64_t key[HILBERT_BATCH];
+      for (uint64_t j = begin; j < end; j += HILBERT_BATCH) {
+        uint64_t n = std::min(HILBERT_BATCH, end - j);
+        hilbert3d_batch(in.list + start + j, n, key);
+        for (uint64_t k = 0; k < n; k++) {
+          sorted[j + k].p = in.list[start + j + k];
+          sorted[j + k].key = key[k];
+        }
+      }
+      std::sort(sorted.begin() + begin, sorted.begin() + end);
+    });
+    // Write the pieces as separate runs, stripping the keys.
+    std::vector<point> block;
+    for (uint64_t begin = 0; begin < length; begin += piece) {
+      uint64_t end = std::min(begin + piece, length);
+      for (uint64_t j = begin; j < end; j += block.size()) {
+        block.resize(std::min<uint64_t>(1<<16, end - j));
+        for (size_t k = 0; k < block.size(); k++) block[k] = sorted[j + k].p;
+        write_fully(fd, block.data(), block.size() * sizeof(point), (start + j) * sizeof(point));
+      }
+      runs.push_back(start + end);
+    }
+  }
+  sorted = std::vector<keyed_point>(); // Release the memory.
+  
+  // Merge the runs, dividing the memory among the input and output buffers.
+  uint64_t k = runs.size() - 1;
+  printf("[%10.0f] Merging %lu sorted runs.\n", t.elapsed(), k);
+  uint64_t block = std::max<uint64_t>(arg.memory / sizeof(point) / (k + 1), 1);
+  std::vector<sorted_run> run(k);
+  typedef std::pair<uint64_t, uint64_t> head; //< The key of the next point of a run and the index of that run.
+  std::priority_queue<head, std::vector<head>, std::greater<head> > heads;
+  for (uint64_t i = 0; i < k; i++) {
+    run[i].next = runs[i];
+    run[i].end = runs[i+1];
+    if (run[i].fill(fd, block)) heads.push(head(hilbert3d(run[i].buffer[0]), i));
+  }
+  std::vector<point> out;
+  out.reserve(block);
+  uint64_t written = 0;
+  while (!heads.empty()) {
+    sorted_run & r = run[heads.top().second];
+    heads.pop();
+    out.push_back(r.buffer[r.pos++]);
+    if (r.pos < r.buffer.size() || r.fill(fd, block)) heads.push(head(hilbert3d(r.buffer[r.pos]), &r - run.data()));
+    if (out.size() == block || heads.empty()) {
+      write_fully(in.fd, out.data(), out.size() * sizeof(point), written * sizeof(point));
+      written += out.size();
+      out.clear();
+    }
+  }
+  assert(written == in.length);
+  close(fd);
+}
+
+/** A Hilbert key together with the index of its point. */
+struct key_index {
+  uint64_t key;
+  uint64_t index;
+};
+
+/** The radix sort uses 5 passes of 12 bits, as the Hilbert keys have 60 bits. */
+static const int RADIX_BITS = 12;
+static const int RADIX_PASSES = 5;
+
+/** Sorts the keys using a parallel, stable LSD radix sort. 
+ * Each thread counts and scatters the keys of its own piece of the array. 
+ * Passes in which all keys have the same digit are skipped. */
+void radix_sort(threadpool &pool, std::vector<key_index> &keys) {
+  const uint64_t mask = (1 << RADIX_BITS) - 1;
+  int threads = pool.size();
+  uint64_t length = keys.size();
+  uint64_t piece = (length + threads - 1) / threads;
+  std::vector<key_index> temp(length);
+  std::vector<uint64_t> count(threads << RADIX_BITS); //< Digit counts per thread, which become the scatter positions.
+  for (int pass = 0; pass < RADIX_PASSES; pass++) {
+    int shift = pass * RADIX_BITS;
+    std::fill(count.begin(), count.end(), 0);
+    pool.run(threads, [&](int i) {
+      uint64_t * c = &count[i << RADIX_BITS];
+      uint64_t end = std::min(length, (i + 1) * piece);
+      for (uint64_t j = std::min(length, i * piece); j < end; j++) c[(keys[j].key >> shift) & mask]++;
+    });
+    uint64_t pos = 0;
+    bool trivial = false;
+    for (uint64_t d = 0; d <= mask; d++) {
+      uint64_t start = pos;
+      for (int i = 0; i < threads; i++) {
+        uint64_t n = count[(i << RADIX_BITS) + d];
+        count[(i << RADIX_BITS) + d] = pos;
+        pos += n;
+      }
+      if (pos - start == length) trivial = true;
+    }
+    if (trivial) continue;
+    pool.run(threads, [&](int i) {
+      uint64_t * c = &count[i << RADIX_BITS];
+      uint64_t end = std::min(length, (i + 1) * piece);
+      for (uint64_t j = std::min(length, i * piece); j < end; j++) temp[c[(keys[j].key >> shift) & mask]++] = keys[j];
+    });
+    keys.swap(temp);
+  }
+}
+
+/** Checks and sorts the points along the Hilbert curve in memory, which requires 32 bytes per point.
+ * The keys are computed once, in parallel, and the points are reordered in a single pass. */
+void radix_sort_points(const arguments &arg, threadpool &pool, pointset &in) {
+  uint64_t piece = (in.length + pool.size() - 1) / pool.size();
+  printf("[%10.0f] Checking if %lu points are sorted.\n", t.elapsed(), in.length);
+  std::vector<key_index> keys(in.length);
+  pool.run(pool.size(), [&](int i) {
+    uint64_t end = std::min(in.length, (i + 1) * piece);
+    uint64_t key[HILBERT_BATCH];
+    for (uint64_t j = std::min(in.length, i * piece); j < end; j += HILBERT_BATCH) {
+      uint64_t n = std::min(HILBERT_BATCH, end - j);
+      hilbert3d_batch(in.list + j, n, key);
+      for (uint64_t k = 0; k < n; k++) {
+        keys[j + k].key = key[k];
+        keys[j + k].index = j + k;
+      }
+    }
+  });
+  uint64_t unsorted = 1;
+  while (unsorted < in.length && keys[unsorted-1].key <= keys[unsorted].key) unsorted++;
+  if (unsorted >= in.length) return;
+  printf("[%10.0f] Point %lu should precede previous point.\n", t.elapsed(), unsorted);
+  if (!in.write) {
+    printf("[%10.0f] Cannot proceed as '%s' is read only.\n", t.elapsed(), arg.infile);
+    exit(1);
+  }
+  
+  printf("[%10.0f] Sorting points in memory.\n", t.elapsed());
+  radix_sort(pool, keys);
+  printf("[%10.0f] Reordering points.\n", t.elapsed());
+  std::vector<point> sorted(in.length);
+  pool.run(pool.size(), [&](int i) {
+    uint64_t end = std::min(in.length, (i + 1) * piece);
+    for (uint64_t j = std::min(in.length, i * piece); j < end; j++) sorted[j] = in.list[keys[j].index];
+  });
+  keys = std::vector<key_index>(); // Release the memory.
+  // The points are only written back once all have been gathered, as the file is mapped.
+  write_fully(in.fd, sorted.data(), in.length * sizeof(point), 0);
+}
+
+void hilbert_sort_points(const arguments &arg, threadpool &pool, pointset &in) {
+  if (in.length * 2 * sizeof(key_index) <= arg.memory) {
+    radix_sort_points(arg, pool, in);
+    return;
+  }
   // Check and possibly sort the data points.
-  printf("[%10.0f] Checking if %d points are sorted.\n", t.elapsed(), in.length);
+  printf("[%10.0f] Checking if %lu points are sorted.\n", t.elapsed(), in.length);
   int64_t old = 0;
   for (uint64_t i=0; i<in.length; i++) {
     if (i && (i&0x3fffff)==0) {
@@ -242,11 +589,7 @@ void hilbert_sort_points(const arguments &arg, pointset &in) {
       printf("[%10.0f] Point %lu should precede previous point.\n", t.elapsed(), i);
       if (in.write) {
         printf("[%10.0f] Sorting points.\n", t.elapsed());
-        in.enable_write(true);
-        // TODO: replace with IO-efficient k-way quicksort, with inline hilbert curve computation.
-        // TODO: branch into multiple threads at some point if cpu usage is high.
-        std::sort(in.list, in.list+in.length, hilbert3d_compare);
-        in.enable_write(false);
+        external_sort(arg, pool, in);
       } else {
         printf("[%10.0f] Cannot proceed as '%s' is read only.\n", t.elapsed(), arg.infile);
         exit(1);
@@ -268,32 +611,8 @@ struct layer_info {
   int bottom_layer;
 };
 
-layer_info count_nodes_per_layer(const arguments &arg, const pointset &in) {
-  layer_info r;
-  // Count nodes per layer
-  // Used to determine file structure and size.
-  // Layers are counted as well.
-  printf("[%10.0f] Counting nodes per layer.\n", t.elapsed());
-  int64_t maxnode=0;
-  for (int j=0; j<D; j++) r.nodecount[j]=0;
-  int64_t old = -1;
-  for (uint64_t i=0; i<in.length; i++) {
-    if (i && (i&0x3fffff)==0) {
-      printf("[%10.0f] Counting ... %6.2f%%.\n", t.elapsed(), i*100.0/in.length);
-    }
-    point q = in.list[i];
-    assert(q.c<0x1000000);    
-    int64_t cur = morton3d(q.x, q.y, q.z);
-    for (int j=0; j<D; j++) {
-      if ((cur>>j*3)!=(old>>j*3)) {
-        r.nodecount[j]++;
-      }
-    }
-    old = cur;
-    if (maxnode<cur)
-      maxnode=cur;
-  }
-  
+/** Determines the top and bottom layers from the node counts and the largest Morton code of the points. */
+void determine_layers(const arguments &arg, layer_info &r, int64_t maxnode) {
   // Determine top layer
   printf("[%10.0f] Counting layers (maxnode=0x%lx).\n", t.elapsed(), maxnode);
   r.top_data_layer = 0;
@@ -321,23 +640,72 @@ layer_info count_nodes_per_layer(const arguments &arg, const pointset &in) {
     }
   }
   // r.bottom_layer++;
-  
+}
+
+/** Counts the nodes per layer that start in the given range of sorted points. 
+ * @param old the Morton code of the point preceding the range, or -1 if every layer starts a node at begin.
+ * @return the largest Morton code in the range. */
+static int64_t count_nodes(const pointset &in, uint64_t begin, uint64_t end, int64_t old, uint64_t * nodecount) {
+  int64_t maxnode=0;
+  for (int j=0; j<D; j++) nodecount[j]=0;
+  for (uint64_t i=begin; i<end; i++) {
+    point q = in.list[i];
+    assert(q.c<0x1000000);    
+    int64_t cur = morton3d(q.x, q.y, q.z);
+    for (int j=0; j<D; j++) {
+      if ((cur>>j*3)!=(old>>j*3)) {
+        nodecount[j]++;
+      }
+    }
+    old = cur;
+    if (maxnode<cur)
+      maxnode=cur;
+  }
+  return maxnode;
+}
+
+layer_info count_nodes_per_layer(const arguments &arg, const pointset &in, threadpool &pool) {
+  layer_info r;
+  // Count nodes per layer
+  // Used to determine file structure and size.
+  // Layers are counted as well.
+  // Each thread counts a part of the points, using the point preceding its part to detect new nodes.
+  printf("[%10.0f] Counting nodes per layer.\n", t.elapsed());
+  int threads = pool.size();
+  uint64_t piece = (in.length + threads - 1) / threads;
+  std::vector<uint64_t> counts(threads * D);
+  std::vector<int64_t> maxnodes(threads);
+  pool.run(threads, [&](int i) {
+    uint64_t begin = std::min(in.length, i * piece);
+    uint64_t end = std::min(in.length, begin + piece);
+    int64_t old = begin ? morton3d(in.list[begin-1].x, in.list[begin-1].y, in.list[begin-1].z) : -1;
+    maxnodes[i] = count_nodes(in, begin, end, old, &counts[i * D]);
+  });
+  int64_t maxnode=0;
+  for (int j=0; j<D; j++) r.nodecount[j]=0;
+  for (int i=0; i<threads; i++) {
+    for (int j=0; j<D; j++) r.nodecount[j] += counts[i * D + j];
+    maxnode = std::max(maxnode, maxnodes[i]);
+  }
+  determine_layers(arg, r, maxnode);
   return r;
 }
 
 /** Describes the structure of the outputfile
- * Note that the layer_start and layer_end are the same type as octree::child 
- * and describe the position in the octree node array.
+ * Note that the layer_start and layer_end describe the position in the octree node array, 
+ * in units of the node type of the format.
  */
 struct file_info {
-  uint32_t layer_start[D];
-  uint32_t layer_end[D];
+  uint64_t layer_start[D];
+  uint64_t layer_end[D];
   uint64_t filesize;
+  octree_format format;
 };
 
 /** Determine index offsets for each layer
+ * @param wide whether the wide format is required, otherwise it is only used if the octree does not fit in the .oc2 format.
  */
-file_info compute_file_structure(const layer_info &layers) {
+file_info compute_file_structure(const layer_info &layers, bool wide) {
   file_info r;
 
   for (int j=0; j<D; j++) {r.layer_start[j]=0; r.layer_end[j]=0;}
@@ -354,101 +722,417 @@ file_info compute_file_structure(const layer_info &layers) {
     r.layer_end[i] = r.layer_start[i] + layers.nodecount[i] + layers.nodecount[i-1]; 
   } 
   // Leaf layer is stored in the parent layer.
-  r.filesize = r.layer_end[layers.bottom_layer+1] * sizeof(octree);
+  uint64_t nodes = r.layer_end[layers.bottom_layer+1];
+  if (!wide && nodes > octree::COLOR) {
+    printf("[%10.0f] The octree has too many nodes for the .oc2 format, using the wide format.\n", t.elapsed());
+    wide = true;
+  }
+  r.format = wide ? OCTREE_FORMAT_WIDE : OCTREE_FORMAT_OC2;
+  r.filesize = nodes * (wide ? sizeof(octree64) : sizeof(octree));
   //for (int j=0; j<D; j++) {printf("Layer %d: %d-%d\n", j, r.layer_start[j], r.layer_end[j]);}
   return r;
 }
 
-void write_points(octree* root, const pointset &in, const layer_info &layers, const file_info &file) {
-  // Read voxels and store them.
-  printf("[%10.0f] Storing points.\n", t.elapsed());
-  uint64_t bytes_written = 0;
-  uint32_t location[D]; //< Writing location for data of each layer.
-  for (uint32_t i=0; i<D; i++) {
-    location[i] = file.layer_start[i];
-  }
-  // Create rootnode
-  root[0].bitmask = 0;
-  root[0].avgcolor = 0xeeeeee;
-  location[layers.top_repeat_layer]++;
-  bytes_written += 4;
-  // Process file.
-  for (uint32_t i=0; i<in.length; i++) {
-    // Periodically print some progress info every 4MiPoints.
-    if (i && (i&0x3fffff)==0) {
-      human_filesize bytes(bytes_written);
-      printf("[%10.0f] Stored %6.2f%% points (%lu%sB).\n", t.elapsed(), i*100.0/in.length, bytes.number, bytes.suffix);
+/** Chooses the layer at which the octree is split into subtrees that are built in parallel.
+ * This is the highest layer that has enough nodes to divide the points evenly among the threads.
+ * Only the nodes above this layer are built by a single thread. */
+int choose_split_layer(const layer_info &layers, int threads) {
+  int split = layers.top_data_layer;
+  while (split > layers.bottom_layer+1 && layers.nodecount[split] < 64 * (uint64_t)threads) split--;
+  return split;
+}
+
+/** A node on the split layer, which is the root of a subtree. */
+struct subtree {
+  uint64_t val;         //< Morton code of the first point in the subtree, as used for writing points.
+  uint64_t location;    //< Location of the node in the octree.
+  weighted_color color; //< Sum of the colors of the leaves of the subtree.
+};
+
+/** A range of sorted points that consists of whole subtrees, which are written by a single thread.
+ * Since the points are sorted, the nodes of these subtrees are consecutive within each layer of the file.
+ */
+struct subtree_range {
+  uint64_t begin, end;          //< The range of points.
+  std::string shard;            //< The file containing the points if they are not in the input file.
+  uint64_t nodecount[D];        //< Number of nodes per layer in the subtrees.
+  uint64_t location[D];         //< Writing location for the subtrees in each layer, up to the split layer.
+  std::vector<subtree> subtrees;
+  subtree_range(uint64_t begin, uint64_t end) : begin(begin), end(end), nodecount(), location() {}
+};
+
+/** Determines where the nodes of each range are written, such that the file has the same layout
+ * as when the points would have been written in order by a single thread. */
+void reserve_locations(std::vector<subtree_range> &ranges, const layer_info &layers, const file_info &file, int split) {
+  for (int j=layers.bottom_layer+1; j<=split; j++) {
+    uint64_t location = file.layer_start[j];
+    for (subtree_range & r : ranges) {
+      r.location[j] = location;
+      location += r.nodecount[j] + r.nodecount[j-1];
     }
+    assert(location <= file.layer_end[j]);
+  }
+}
+
+/** Splits the points into ranges of about equal length, about 4 per thread, that end at the boundary of a subtree, 
+ * and counts the nodes of each range. */
+std::vector<subtree_range> partition_points(threadpool &pool, const pointset &in, int split) {
+  printf("[%10.0f] Splitting the octree into subtrees at layer %d.\n", t.elapsed(), split);
+  std::vector<subtree_range> ranges;
+  uint64_t n = 4 * pool.size();
+  uint64_t begin = 0;
+  for (uint64_t k = 1; begin < in.length; k++) {
+    uint64_t end = std::min(std::max(begin + 1, in.length * k / n), in.length);
+    const point & last = in.list[end-1];
+    uint64_t prefix = morton3d(last.x, last.y, last.z) >> split*3;
+    while (end < in.length && (morton3d(in.list[end].x, in.list[end].y, in.list[end].z) >> split*3) == prefix) end++;
+    ranges.push_back(subtree_range(begin, end));
+    begin = end;
+  }
+  pool.run(ranges.size(), [&](int i) {
+    count_nodes(in, ranges[i].begin, ranges[i].end, -1, ranges[i].nodecount);
+  });
+  return ranges;
+}
+
+/** Writes the subtrees of the given range and computes their average colors. 
+ * @param list the points, of which the range is written. */
+template<class octree_node>
+void write_subtrees(octree_node* root, const point * list, const layer_info &layers, int split, subtree_range &r) {
+  uint64_t location[D]; //< Writing location for data of each layer.
+  std::copy(r.location, r.location + D, location);
+  octree_node * cur = nullptr;
+  uint64_t prefix = ~uint64_t(0);
+  for (uint64_t i=r.begin; i<r.end; i++) {
     // Proces the next point.
-    point p(in.list[i]);
+    point p(list[i]);
     uint64_t val = morton3d(p.z, p.y, p.x);
-    octree * cur = root;
-    //printf("val=%15lx, p{x=%d,y=%d,z=%d,c=%6x}.\n", val, p.x, p.y, p.z, p.c);
-    for (int depth = layers.top_repeat_layer-1; depth >= layers.bottom_layer; depth--) {
+    // Create the root of a new subtree if needed.
+    if ((val >> split*3) != prefix) {
+      prefix = val >> split*3;
+      subtree s;
+      s.val = val;
+      s.location = location[split]++;
+      root[s.location].bitmask = 0;
+      root[s.location].avgcolor = 0xeeeeee;
+      r.subtrees.push_back(s);
+    }
+    cur = &root[r.subtrees.back().location];
+    for (int depth = split-1; depth >= layers.bottom_layer; depth--) {
       // Extract the child index for the current layer based from the morton code.
       uint32_t index = (val >> depth*3)&7;
       uint32_t pos = cur->insert_index(index);
-      //printf("i=%u, depth=%d, index=%d, pos=%d, location[depth]=%u, cur=%ld.\n", i, depth, index, pos, location[depth+1], cur-root);
       
       if (depth <= layers.bottom_layer) {
         if (cur->child[pos] == 0) {
-          assert(location[depth+1]<file.layer_end[depth+1]);
           location[depth+1]++; // Create entry in this layer
-          bytes_written += 4;
         }
         // Bottom layer stores child colors instead of child pointers.
         cur->set_color(pos, p.c);
-        //printf("Created leaf (%ldB)\n", bytes_written);
       } else {
         // Check if we need to create a new node.
         if (cur->child[pos] == 0) {
-          // Is there still sufficient bytes left?
-          assert(location[depth+1]<file.layer_end[depth+1]);
-          assert(location[depth]<file.layer_end[depth]);
-          assert(bytes_written<file.filesize);
           // Get location for new node.
-          uint32_t next = location[depth];
+          uint64_t next = location[depth];
           // Assign bytes to the new node.
           location[depth+1]++; // Create entry in this layer
           location[depth]++; // Create node in lower layer
-          bytes_written += 8;
           // Initialize new node.
-          //printf("Created node %d (%ldB)\n", next, bytes_written);
           root[next].bitmask = 0;
           root[next].avgcolor = 0xeeeeee;
           cur->child[pos] = next;
         }
-        assert(cur->child[pos]<file.layer_end[depth]);
         cur = &root[cur->child[pos]];
       }
     }
   }
+  // Check that the subtrees filled exactly the space that was reserved for them.
+  for (int j=layers.bottom_layer+1; j<=split; j++) {
+    assert(location[j] == r.location[j] + r.nodecount[j] + r.nodecount[j-1]);
+  }
+  for (subtree & s : r.subtrees) {
+    s.color = average(root, s.location);
+  }
 }
 
-int main(int argc, char ** argv){ 
-  arguments arg = parse_arguments(argc, argv);
+/** Creates the nodes above the split layer, linking them to the subtrees. */
+template<class octree_node>
+void write_top_layers(octree_node* root, const layer_info &layers, const file_info &file, int split, const std::vector<subtree> &subtrees) {
+  if (split == layers.top_repeat_layer) return; // The root is the only subtree.
+  uint64_t location[D]; //< Writing location for data of each layer.
+  for (uint32_t i=0; i<D; i++) {
+    location[i] = file.layer_start[i];
+  }
+  // Create rootnode
+  root[0].bitmask = 0;
+  root[0].avgcolor = 0xeeeeee;
+  location[layers.top_repeat_layer]++;
+  for (const subtree & s : subtrees) {
+    octree_node * cur = root;
+    for (int depth = layers.top_repeat_layer-1; depth >= split; depth--) {
+      uint32_t index = (s.val >> depth*3)&7;
+      uint32_t pos = cur->insert_index(index);
+      if (cur->child[pos] == 0) {
+        assert(location[depth+1]<file.layer_end[depth+1]);
+        location[depth+1]++; // Create entry in this layer
+        if (depth == split) {
+          cur->child[pos] = s.location;
+        } else {
+          assert(location[depth]<file.layer_end[depth]);
+          uint64_t next = location[depth];
+          location[depth]++; // Create node in lower layer
+          root[next].bitmask = 0;
+          root[next].avgcolor = 0xeeeeee;
+          cur->child[pos] = next;
+        }
+      }
+      cur = &root[cur->child[pos]];
+    }
+  }
+}
+
+/** Computes the average colors of the nodes above the split layer, using the colors of the subtrees. */
+template<class octree_node>
+weighted_color average_top_layers(octree_node* root, uint64_t index, int layer, int split, const std::vector<subtree> &subtrees) {
+  if (layer == split) {
+    std::vector<subtree>::const_iterator s = std::lower_bound(subtrees.begin(), subtrees.end(), index, 
+      [](const subtree & a, uint64_t location) { return a.location < location; });
+    assert(s != subtrees.end() && s->location == index);
+    return s->color;
+  }
+  octree_node &node = root[index];
+  int n = node.size();
+  assert(n>0);
+  weighted_color c;
+  for (int i=0; i<n; i++) {
+    c += node.is_pointer(i) ? average_top_layers(root, node.child[i], layer-1, split, subtrees) : weighted_color(node.color(i));
+  }
+  node.avgcolor = c.color();
+  return c;
+}
+
+/** Builds the octree in parallel. The subtrees below the split layer are written and averaged by the threads,
+ * after which the layers above it are built. 
+ * @param list the points of the ranges that are not stored in a shard. */
+template<class octree_node>
+void build_octree(octree_node* root, const arguments &arg, threadpool &pool, const point * list, const layer_info &layers, const file_info &file, int split, std::vector<subtree_range> &ranges) {
+  printf("[%10.0f] Storing points of %lu subtrees in %lu parts.\n", t.elapsed(), layers.nodecount[split], ranges.size());
+  pool.run(ranges.size(), [&](int i) {
+    if (ranges[i].shard.empty()) {
+      write_subtrees(root, list, layers, split, ranges[i]);
+    } else {
+      pointset shard(ranges[i].shard.c_str());
+      write_subtrees(root, shard.list, layers, split, ranges[i]);
+      unlink(ranges[i].shard.c_str());
+    }
+  });
   
-  // Map input file to memory
-  printf("[%10.0f] Opening '%s' read/write.\n", t.elapsed(), arg.infile);
-  pointset in(arg.infile, true);
+  printf("[%10.0f] Storing top %d layers.\n", t.elapsed(), layers.top_repeat_layer - split);
+  std::vector<subtree> subtrees;
+  for (const subtree_range & r : ranges) {
+    subtrees.insert(subtrees.end(), r.subtrees.begin(), r.subtrees.end());
+  }
+  write_top_layers(root, layers, file, split, subtrees);
   
-  hilbert_sort_points(arg, in);
+  printf("[%10.0f] Computing average colors.\n", t.elapsed());
+  average_top_layers(root, 0, layers.top_repeat_layer, split, subtrees);
   
-  layer_info layers = count_nodes_per_layer(arg, in);
-  file_info file = compute_file_structure(layers);
+  printf("[%10.0f] Replicating model.\n", t.elapsed());
+  replicate(root, 0, arg.repeat_mask, arg.repeat_depth);
+}
+
+/** A file containing the points of a single node, in the order in which they were read. */
+struct shard {
+  std::string filename;
+  int layer;       //< The layer of the node.
+  uint64_t prefix; //< The Hilbert key of the points, shifted right by 3*layer bits.
+  uint64_t length; //< Number of points.
+  int fd;          //< The opened file while points are distributed over the shard, or -1.
+};
+
+/** The number of child shards into which the points of a shard are distributed, which are the nodes 3 layers lower. */
+static const int SHARD_FANOUT = 512;
+/** The layer of the initial shards. As the Hilbert keys have 60 bits, layer 20 contains a single node. */
+static const int SHARD_TOP_LAYER = 17;
+/** Shards at this layer are not split further. If these do not fit in memory, they are sorted by the external merge sort. */
+static const int SHARD_MIN_LAYER = 5;
+
+/** Reads up to n points from the given file, stopping only at the end of the file. @return the number of points read. */
+static uint64_t read_points(int fd, point * list, uint64_t n) {
+  uint64_t size = 0;
+  char * bytes = (char *)list;
+  while (size < n * sizeof(point)) {
+    ssize_t r = read(fd, bytes + size, n * sizeof(point) - size);
+    if (r < 0) {perror("Could not read points"); exit(1);}
+    if (r == 0) break;
+    size += r;
+  }
+  if (size % sizeof(point)) {fprintf(stderr, "Input ends with a partial point.\n"); exit(1);}
+  return size / sizeof(point);
+}
+
+/** Reads the points from the given file until its end and distributes them over the shards of the nodes at the given layer. 
+ * Each shard is buffered in memory, such that all buffers together use half of the memory budget.
+ * @param prefix the prefix of the Hilbert keys of the points, shifted right by 3*(layer+3) bits. 
+ * @param shards the nonempty shards are appended to this, in the order of the Hilbert curve. */
+void distribute_points(const arguments &arg, int fd, int layer, uint64_t prefix, std::vector<shard> &shards) {
+  static uint64_t count = 0; //< Number of shards created, used for their file names.
+  uint64_t capacity = std::max<uint64_t>(1, arg.memory / 2 / SHARD_FANOUT / sizeof(point));
+  std::vector<shard> child(SHARD_FANOUT);
+  std::vector<std::vector<point> > buffer(SHARD_FANOUT);
+  for (int i=0; i<SHARD_FANOUT; i++) {
+    child[i].layer = layer;
+    child[i].prefix = prefix * SHARD_FANOUT + i;
+    child[i].length = 0;
+    child[i].fd = -1;
+    buffer[i].reserve(capacity);
+  }
+  // Appends the buffered points to the shard, creating its file if necessary.
+  auto flush = [&](int i) {
+    if (child[i].fd == -1) {
+      child[i].filename = std::string(arg.outfile) + ".shard" + std::to_string(count++);
+      child[i].fd = open(child[i].filename.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600);
+      if (child[i].fd == -1) {perror("Could not create shard file"); exit(1);}
+    }
+    write_fully(child[i].fd, buffer[i].data(), buffer[i].size() * sizeof(point), child[i].length * sizeof(point));
+    child[i].length += buffer[i].size();
+    buffer[i].clear();
+  };
+  std::vector<point> block(1<<16);
+  uint64_t key[HILBERT_BATCH];
+  uint64_t n;
+  while ((n = read_points(fd, block.data(), block.size())) > 0) {
+    for (uint64_t j = 0; j < n; j += HILBERT_BATCH) {
+      uint64_t m = std::min(HILBERT_BATCH, n - j);
+      hilbert3d_batch(&block[j], m, key);
+      for (uint64_t k = 0; k < m; k++) {
+        int i = (key[k] >> layer*3) % SHARD_FANOUT;
+        buffer[i].push_back(block[j + k]);
+        if (buffer[i].size() == capacity) flush(i);
+      }
+    }
+  }
+  for (int i=0; i<SHARD_FANOUT; i++) {
+    if (!buffer[i].empty()) flush(i);
+    if (child[i].fd != -1) {
+      close(child[i].fd);
+      shards.push_back(child[i]);
+    }
+  }
+}
+
+/** Distributes the points of a shard that does not fit in memory over the shards of its children, recursively. 
+ * The resulting shards are appended to out. */
+void split_shard(const arguments &arg, const shard &s, std::vector<shard> &out) {
+  if (s.length * 2 * sizeof(key_index) <= arg.memory || s.layer <= SHARD_MIN_LAYER) {
+    out.push_back(s);
+    return;
+  }
+  int fd = open(s.filename.c_str(), O_RDONLY);
+  if (fd == -1) {perror("Could not open shard file"); exit(1);}
+  std::vector<shard> children;
+  distribute_points(arg, fd, s.layer - 3, s.prefix, children);
+  close(fd);
+  unlink(s.filename.c_str());
+  for (const shard & c : children) {
+    split_shard(arg, c, out);
+  }
+}
+
+/** Reads the points from the input file, or stdin if it is "-", and stores them in shards of at most the memory budget. 
+ * The shards are sorted and counted, such that each becomes a range of subtrees.
+ * @param split is set to the split layer, which is the lowest layer of the shards. */
+std::vector<subtree_range> stream_points(const arguments &arg, threadpool &pool, layer_info &layers, int &split) {
+  int fd = 0;
+  if (strcmp(arg.infile, "-") != 0) {
+    fd = open(arg.infile, O_RDONLY);
+    if (fd == -1) {perror("Could not open input file"); exit(1);}
+  }
+  printf("[%10.0f] Distributing points over shards.\n", t.elapsed());
+  std::vector<shard> top, shards;
+  distribute_points(arg, fd, SHARD_TOP_LAYER, 0, top);
+  if (fd != 0) close(fd);
+  for (const shard & s : top) {
+    split_shard(arg, s, shards);
+  }
+  
+  printf("[%10.0f] Sorting and counting %lu shards.\n", t.elapsed(), shards.size());
+  std::vector<subtree_range> ranges;
+  int64_t maxnode = 0;
+  int64_t old = -1;
+  for (int j=0; j<D; j++) layers.nodecount[j]=0;
+  for (const shard & s : shards) {
+    pointset points(s.filename.c_str(), true);
+    hilbert_sort_points(arg, pool, points);
+    subtree_range r(0, points.length);
+    r.shard = s.filename;
+    // Counting continues from the previous shard, which yields the node counts of the entire octree.
+    maxnode = std::max(maxnode, count_nodes(points, 0, points.length, old, r.nodecount));
+    const point & last = points.list[points.length - 1];
+    old = morton3d(last.x, last.y, last.z);
+    for (int j=0; j<D; j++) layers.nodecount[j] += r.nodecount[j];
+    ranges.push_back(r);
+  }
+  if (ranges.empty()) {fprintf(stderr, "The input contains no points.\n"); exit(1);}
+  determine_layers(arg, layers, maxnode);
+  
+  // Each shard consists of whole subtrees at the lowest layer of the shards, or of the single node at the top data layer.
+  split = layers.top_data_layer;
+  for (const shard & s : shards) split = std::min(split, s.layer);
+  if (split <= layers.bottom_layer) {fprintf(stderr, "The shards are too small for the pruned layers.\n"); exit(1);}
+  return ranges;
+}
+
+int main(int argc, char ** argv){ 
+  arguments arg = parse_arguments(argc, argv);
+  threadpool pool(arg.threads);
+  
+  layer_info layers;
+  int split;
+  std::vector<subtree_range> ranges;
+  pointset * in = nullptr;
+  if (arg.stream) {
+    ranges = stream_points(arg, pool, layers, split);
+  } else {
+    // Map input file to memory
+    printf("[%10.0f] Opening '%s' read/write.\n", t.elapsed(), arg.infile);
+    in = new pointset(arg.infile, true);
+    
+    hilbert_sort_points(arg, pool, *in);
+    
+    layers = count_nodes_per_layer(arg, *in, pool);
+    split = choose_split_layer(layers, pool.size());
+    ranges = partition_points(pool, *in, split);
+  }
+  file_info file = compute_file_structure(layers, arg.wide);
+  reserve_locations(ranges, layers, file, split);
   
   // Prepare output file and map it to memory
+  // The compact and split formats are encoded from the octree, which is then built in a temporary file instead.
+  bool encode = arg.encoding != OCTREE_FORMAT_OC2;
+  std::string outfile = encode ? std::string(arg.outfile) + ".tmp" : std::string(arg.outfile);
   human_filesize size(file.filesize);
   printf("[%10.0f] Creating octree file (%lu%sB).\n", t.elapsed(), size.number, size.suffix);
-  octree_file out(arg.outfile, file.filesize);
+  octree_file out(outfile.c_str(), file.filesize, file.format);
   
-  write_points(out.root, in, layers, file);
-  
-  printf("[%10.0f] Computing average colors.\n", t.elapsed());
-  average(out.root, 0);
+  const point * list = in ? in->list : nullptr;
+  if (file.format == OCTREE_FORMAT_WIDE) {
+    build_octree(out.nodes<octree64>(), arg, pool, list, layers, file, split, ranges);
+  } else {
+    build_octree(out.nodes<octree>(), arg, pool, list, layers, file, split, ranges);
+  }
+  delete in;
   
-  printf("[%10.0f] Replicating model.\n", t.elapsed());
-  replicate(out.root, 0, arg.repeat_mask, arg.repeat_depth);
+  if (arg.encoding == OCTREE_FORMAT_COMPACT) {
+    printf("[%10.0f] Encoding octree in the compact format.\n", t.elapsed());
+    octree_compact_encode(&out, arg.outfile);
+  } else if (arg.encoding == OCTREE_FORMAT_SPLIT) {
+    printf("[%10.0f] Encoding octree in the split format.\n", t.elapsed());
+    octree_split_encode(&out, arg.outfile);
+  }
+  if (encode) {
+    unlink(outfile.c_str());
+  }
 
   // Done with conversion, clean up.
   printf("[%10.0f] Done.\n", t.elapsed());
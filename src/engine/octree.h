@@ -36,13 +36,19 @@ static inline int popcount(int v) {
  * 1 = neg-x, neg-y, pos-z
  * etc...
  * 
+ * The child array contains the positions of the child nodes, in units of the size of this struct, 
+ * or the colors of leaf children, which have their upper bits set, see set_color.
+ * @tparam child_t the type of the child array entries, which limits the number of nodes in an octree file.
  */
-struct octree {
+template<class child_t>
+struct basic_octree {
     uint32_t avgcolor:24;
     uint32_t bitmask : 8;
-    uint32_t child[0];
+    child_t child[0];
+    /** Entries of the child array that are at least this value are colors. */
+    static const child_t COLOR = ~child_t(0) << 24;
     /** Checks if a given position in the child array is a pointer. */
-    bool is_pointer(int pos) const { return child[pos] < 0xff000000u; }
+    bool is_pointer(int pos) const { return child[pos] < COLOR; }
     /** Returns the color of a given position in the child array (assuming it is not a pointer). */
     uint32_t color(int pos) const { return child[pos] & 0x00ffffffu; }
     /** Converts an index (0-7) into a position in the child array, assuming it is in the child array. */
@@ -63,28 +69,226 @@ struct octree {
         child[pos] = 0;
         return pos;
     }
-    void set_color(int pos, uint32_t color) { child[pos] = (color | 0xff000000u); }
+    void set_color(int pos, uint32_t color) { child[pos] = (color | COLOR); }
 };
 
+/** The nodes of .oc2 files, which have 32 bit child entries. Hence these can contain less than 0xff000000 nodes. */
+typedef basic_octree<uint32_t> octree;
+/** The nodes of wide octree files, which have 64 bit child entries, for scenes that do not fit in an .oc2 file. */
+typedef basic_octree<uint64_t> octree64;
+
+/** A node in an octree file in the compact format, which stores child pointers as 16 bit offsets.
+ * 
+ * Positions in the node array are in units of 4 bytes. 
+ * Nodes are referenced by (position<<1)|LEAVES, where the LEAVES flag is set if all children of the node are leaves. 
+ * The child array of such a node contains the colors of its children, which are 4 bytes each.
+ * Otherwise the child array has a 16 bit entry per child, padded to a multiple of 4 bytes. 
+ * The entry stores the flags LEAVES, FAR and COLOR, and an offset relative to the node's position.
+ * If neither FAR nor COLOR is set, the offset is the position of the child. 
+ * If FAR is set, it is the position of a far pointer, which is the 64 bit position of the child 
+ * stored as two 32 bit halves, least significant first. The far pointers are placed directly after the child array. 
+ * If COLOR is set, the child is a leaf and the offset is the position of its color, 
+ * which are placed after the far pointers. 
+ * Nodes are stored in depth first order, such that most children are within reach of the offset.
+ */
+struct octree_compact {
+    uint32_t avgcolor:24;
+    uint32_t bitmask : 8;
+    /** Flag of references and child entries to nodes whose children are leaves. */
+    static const uint16_t LEAVES = 1;
+    /** Flag of child entries whose offset is the position of a far pointer. */
+    static const uint16_t FAR = 2;
+    /** Flag of child entries of leaves, whose offset is the position of the leaf's color. */
+    static const uint16_t COLOR = 4;
+    /** The offset of a child entry is stored in the bits above its flags. */
+    static const int OFFSET_SHIFT = 3;
+    static const uint32_t MAX_OFFSET = 0xffff >> OFFSET_SHIFT;
+    /** Converts an index (0-7) into a position in the child array, assuming it is in the child array. */
+    uint32_t position(int index) const { return popcount(bitmask & ((1<<index) - 1)); }
+    /** Returns the length of the child array. */
+    uint32_t size() const { return popcount(bitmask); }
+    /** Checks whether a certain index is in the child array. */
+    bool has_index(int index) const { return bitmask & (1<<index); }
+    /** The child array of a node that has children which are nodes. */
+    const uint16_t * entries() const { return reinterpret_cast<const uint16_t*>(this + 1); }
+    /** The child array of a node whose children are all leaves. */
+    const uint32_t * colors() const { return reinterpret_cast<const uint32_t*>(this + 1); }
+};
+
+/** A node in the topology array of an octree file in the split format, which stores the colors in a separate array. 
+ * Hence the traversal does not read colors, except for the nodes and leaves that are drawn.
+ * 
+ * Positions in the topology array and color array are in units of 4 bytes, and nodes are referenced by their position.
+ * The color array contains, for each node, its average color followed by the colors of the children that are leaves.
+ */
+struct octree_split {
+    uint32_t bitmask : 8;
+    uint32_t leaves : 8; //< The children that are leaves, which is a subset of bitmask.
+    uint32_t : 16;
+    uint32_t color;      //< Position of the average color in the color array, which is followed by the colors of the leaves.
+    uint32_t child[0];   //< Positions of the children that are not leaves.
+    /** Checks whether the child with the given index (0-7) is a leaf. */
+    bool is_leaf(int index) const { return leaves & (1<<index); }
+    /** Converts the index (0-7) of a child that is not a leaf into a position in the child array. */
+    uint32_t position(int index) const { return popcount((bitmask & ~leaves) & ((1<<index) - 1)); }
+    /** Converts the index (0-7) of a leaf into its position in the color array, relative to the average color. */
+    uint32_t leaf_position(int index) const { return 1 + popcount(leaves & ((1<<index) - 1)); }
+    /** Returns the length of the child array. */
+    uint32_t size() const { return popcount(bitmask & ~leaves); }
+};
+
+/** The formats of octree files. */
+enum octree_format {
+    OCTREE_FORMAT_OC2     = 0, //< The nodes are of type octree, without any header.
+    OCTREE_FORMAT_WIDE    = 1, //< The nodes are of type octree64, after an octree_header.
+    OCTREE_FORMAT_COMPACT = 2, //< The nodes are of type octree_compact, after an octree_header.
+    OCTREE_FORMAT_SPLIT   = 3, //< The nodes are of type octree_split, after an octree_header, followed by the color array.
+};
+
+/** Header of octree files, except for those in the OC2 format, which start with the root node instead. 
+ * The magic number ends with a zero byte, which is at the position of the bitmask of an OC2 root node. 
+ * As that bitmask is never 0, the formats cannot be confused. */
+struct octree_header {
+    char magic[4];     //< OCTREE_MAGIC
+    uint32_t format;   //< One of the octree_format values.
+    uint64_t root;     //< Reference to the root node, which is 0 unless the format references nodes differently than by position.
+    uint64_t colors;   //< Position of the color array in the node array in units of 4 bytes, for the split format.
+};
+static const char OCTREE_MAGIC[4] = {'o','c','x',0};
+
 struct octree_file {
     const bool write;
-    uint32_t size;
+    octree_format format;
+    uint64_t size; //< Size of the node array in bytes.
     int32_t fd;
+    /** The root node, which is at the start of the node array. 
+     * For formats other than OCTREE_FORMAT_OC2, it must be cast to the node type of the format, see nodes. */
     octree * root;
     /** Maps the given octree file to memory for reading and rendering. */
     octree_file(const char * filename);
-    /** Creates an octree file with the given name and size for writing. */
-    octree_file(const char * filename, uint32_t size);
+    /** Creates an octree file with the given name, format and size of its node array for writing. */
+    octree_file(const char * filename, uint64_t size, octree_format format = OCTREE_FORMAT_OC2);
     ~octree_file();
+    /** Returns the node array, which must consist of nodes of the given type. */
+    template<class node> node * nodes() const { return reinterpret_cast<node*>(root); }
+    /** Returns the header, or nullptr for the OC2 format, which has none. */
+    octree_header * header() const { return format == OCTREE_FORMAT_OC2 ? nullptr : reinterpret_cast<octree_header*>(root) - 1; }
+    /** Size of the header in bytes of files in the given format, which precedes the node array in the file. */
+    static uint64_t header_size(octree_format format) { return format == OCTREE_FORMAT_OC2 ? 0 : sizeof(octree_header); }
 private:
     octree_file(octree_file &);
     octree_file& operator=(octree_file&);
+    uint64_t header_size() const { return header_size(format); }
 };
 
+/** Size of a page of memory in bytes. */
+static const uint32_t OCTREE_PAGE_SIZE = 4096;
+
+/** Writes a copy of the given octree to the file with the given name, with its nodes reordered such that subtrees are clustered.
+ * Each page is filled breadth first with the top of a subtree. The subtrees that did not fit are placed after it, depth first. 
+ * Hence a traversal from the root to a leaf touches few pages, instead of one page per layer. 
+ * Nodes that are shared by multiple parents are copied once. The copy has the same format. 
+ * Files in the compact or split format cannot be relayouted, as their layout is fixed by their encoding. */
+void octree_relayout(const octree_file * in, const char * filename);
+
+/** Writes a copy of the given octree to the file with the given name in the compact format, see octree_compact. 
+ * The octree must be in the OC2 or wide format. Nodes that are shared by multiple parents are copied once. */
+void octree_compact_encode(const octree_file * in, const char * filename);
+
+/** Writes a copy of the given octree to the file with the given name, in which identical subtrees are merged, 
+ * such that the octree becomes a directed acyclic graph. The copy has the same format, which must be the OC2 or wide format.
+ * @return the size of the node array of the copy in bytes. */
+uint64_t octree_deduplicate(const octree_file * in, const char * filename);
+
+/** Writes a copy of the given octree to the file with the given name in the split format, see octree_split. 
+ * The octree must be in the OC2 or wide format. Nodes that are shared by multiple parents are copied once. */
+void octree_split_encode(const octree_file * in, const char * filename);
+
 struct view_pane {
     double left, right, top, bottom;
 };
 
+struct quadtree;
+struct threadpool;
+
+/** Renders octrees to surfaces.
+ * A renderer owns the occlusion quadtree and all other state needed for drawing a frame.
+ * Hence multiple renderers can draw at the same time, for example from different threads, 
+ * while sharing the same octree_file.
+ */
+struct octree_renderer {
+    /** Statistics of the last rendered frame. */
+    int count, count_oct, count_quad;
+    
+    /** Level of detail cutoff in pixels. 
+     * Once an octree node is projected smaller than this, the quadtree node it is being drawn to is 
+     * filled with the average color of the octree node, instead of traversing it further. 
+     * Disabled if 0, which is the default. */
+    int lod;
+    
+    /** Time budget for rendering a frame in milliseconds. Disabled if 0, which is the default.
+     * When the traversal runs out of time, the remainder of the frame is drawn at the coarsest level of detail.
+     * Furthermore, the level of detail cutoff is raised above lod when the previous frame came close
+     * to exceeding its budget, and lowered again when it finished well within its budget. */
+    double budget;
+    
+    /** Whether the pixels that no octree node was drawn to are filled with the background color, 
+     * using the occlusion quadtree to find them. Their depth is set to ~0u, like surface::clear does. 
+     * Hence the surface need not be cleared before drawing. Disabled by default. */
+    bool fill_background;
+    uint32_t background; //< The color used by fill_background.
+    
+    octree_renderer(int threads = 1);
+    ~octree_renderer();
+    
+    /** Sets the number of threads used for drawing. 
+     * If more than one, the surface is split into tiles, which are rendered in parallel. 
+     * The result is identical to rendering with a single thread. */
+    void set_threads(int threads);
+    
+    /** Sets whether pixels are first drawn to buffers in the Morton order of the quadtree. 
+     * These are copied to the surface after the traversal, which avoids scattered writes during the traversal.
+     * The result is identical to drawing to the surface directly. Disabled by default. */
+    void set_deferred(bool enabled);
+    
+    /** Restricts drawing to the pixels in columns x0 up to x1 and rows y0 up to y1 of the surface.
+     * Pixels outside this rectangle are left untouched. By default the entire surface is drawn. */
+    void set_scissor(uint32_t x0, uint32_t y0, uint32_t x1, uint32_t y1);
+    
+    /** Render the octree to the provided surface for the given viewpane, position and orientation.
+     * @param file the octree that is being rendered.
+     * @param surf the surface that is being rendered to.
+     * @param position the position of the camera.
+     * @param orientation the orientation of the camera (which is assumed to be orthogonal).
+     */
+    void draw(octree_file* file, surface surf, view_pane view, glm::dvec3 position, glm::dmat3 orientation);
+private:
+    quadtree * face;
+    threadpool * pool;
+    int budget_lod; //< The level of detail cutoff chosen to meet the time budget.
+    octree_renderer(const octree_renderer&);
+    octree_renderer& operator=(const octree_renderer&);
+};
+
+/** Renders using a renderer that is shared by all calls to octree_draw. */
 void octree_draw(octree_file* file, surface surf, view_pane view, glm::dvec3 position, glm::dmat3 orientation);
 
+/** Sets the number of threads used by octree_draw. */
+void octree_set_threads(int threads);
+
+/** Sets the level of detail cutoff used by octree_draw, see octree_renderer::lod. */
+void octree_set_lod(int pixels);
+
+/** Sets the time budget in milliseconds used by octree_draw, see octree_renderer::budget. */
+void octree_set_budget(double milliseconds);
+
+/** Sets whether octree_draw fills the pixels not covered by the octree with the given color, see octree_renderer::fill_background. */
+void octree_set_background(bool enabled, uint32_t color = 0);
+
+/** Sets whether octree_draw draws to Morton ordered buffers first, see octree_renderer::set_deferred. */
+void octree_set_deferred(bool enabled);
+
+/** Restricts octree_draw to a rectangle of the surface, see octree_renderer::set_scissor. */
+void octree_set_scissor(uint32_t x0, uint32_t y0, uint32_t x1, uint32_t y1);
+
 #endif
@@ -0,0 +1,153 @@
+/*
+    Voxel-Engine - A CPU based sparse octree renderer.
+    Copyright (C) 2015  B.J. Conijn <bcmpinc@users.sourceforge.net>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <cstdio>
+#include <cstdlib>
+#include <cassert>
+#include <vector>
+#include <unordered_set>
+#include <algorithm>
+
+#include "octree.h"
+
+/** Marks a node in the input that has not been deduplicated yet. */
+static const uint64_t UNPLACED = ~uint64_t(0);
+/** Marks a node in the input whose subtree is being deduplicated. Reaching such a node again means that the octree is cyclic. */
+static const uint64_t IN_PROGRESS = ~uint64_t(1);
+
+/** Merges identical subtrees of an octree, whose nodes have child entries of type child_t.
+ * The subtrees are deduplicated bottom up: after the children of a node have been replaced by their unique copies, 
+ * the node is identical to another node exactly if their subtrees are identical. 
+ * The unique nodes are stored in the output array in the order in which they were completed, 
+ * except for the root, which is at the start of the output array. */
+template<class child_t>
+struct dag_builder {
+  typedef basic_octree<child_t> octree_node;
+  
+  /** Hashes the node at the given position in the output array. */
+  struct node_hash {
+    const std::vector<child_t> * out;
+    size_t operator()(child_t pos) const {
+      const child_t * words = out->data() + pos;
+      uint32_t size = 1 + reinterpret_cast<const octree_node *>(words)->size();
+      uint64_t h = 0;
+      for (uint32_t i = 0; i < size; i++) {
+        h = (h ^ words[i]) * 0x9e3779b97f4a7c15ull;
+      }
+      return h ^ (h >> 32);
+    }
+  };
+  
+  /** Checks whether the nodes at the given positions in the output array are identical. */
+  struct node_equal {
+    const std::vector<child_t> * out;
+    bool operator()(child_t a, child_t b) const {
+      const child_t * words = out->data();
+      uint32_t size = 1 + reinterpret_cast<const octree_node *>(words + a)->size();
+      return std::equal(words + a, words + a + size, words + b);
+    }
+  };
+  
+  const octree_node * root;
+  /** Maps positions in the input to the positions of their unique copies in the output. */
+  std::vector<child_t> index;
+  /** The output node array. */
+  std::vector<child_t> out;
+  /** The positions of the unique nodes in the output array, except for the root. */
+  std::unordered_set<child_t, node_hash, node_equal> unique;
+  
+  dag_builder(const octree_node * root, child_t n) : 
+    root(root), index(n, child_t(UNPLACED)), unique(0, node_hash{&out}, node_equal{&out}) {}
+  
+  /** Writes a copy of the given node to the given position in the output array, 
+   * with its child pointers replaced by the positions of their unique copies. */
+  void write(child_t pos, const octree_node & node, const child_t * child) {
+    octree_node & copy = *reinterpret_cast<octree_node *>(&out[pos]);
+    copy.avgcolor = node.avgcolor;
+    copy.bitmask = node.bitmask;
+    std::copy(child, child + node.size(), copy.child);
+  }
+  
+  /** Deduplicates the children of the given node, and stores their new child entries in child. */
+  void deduplicate_children(const octree_node & node, child_t * child) {
+    for (uint32_t k = 0; k < node.size(); k++) {
+      child[k] = node.is_pointer(k) ? deduplicate(node.child[k]) : node.child[k];
+    }
+  }
+  
+  /** Returns the position of the unique copy of the subtree of the given node in the output array. */
+  child_t deduplicate(child_t i) {
+    if (index[i] == child_t(IN_PROGRESS)) {
+      // A cyclic octree has no bottom from which its subtrees can be compared.
+      fprintf(stderr, "Cyclic octrees cannot be deduplicated.\n"); 
+      exit(1);
+    }
+    if (index[i] != child_t(UNPLACED)) return index[i];
+    index[i] = child_t(IN_PROGRESS);
+    const octree_node & node = root[i];
+    child_t child[8];
+    deduplicate_children(node, child);
+    child_t pos = out.size();
+    out.resize(pos + 1 + node.size());
+    write(pos, node, child);
+    auto result = unique.insert(pos);
+    if (!result.second) {
+      // An identical node already exists, hence the copy is dropped.
+      out.resize(pos);
+      pos = *result.first;
+    }
+    return index[i] = pos;
+  }
+  
+  /** Deduplicates the whole octree. The root is placed first, as it must be at the start of the output array. */
+  void run() {
+    const octree_node & node = root[0];
+    out.resize(1 + node.size());
+    index[0] = child_t(IN_PROGRESS);
+    child_t child[8];
+    deduplicate_children(node, child);
+    write(0, node, child);
+    index[0] = 0;
+  }
+};
+
+/** Deduplicates the given octree, whose nodes have child entries of type child_t.
+ * @param n the number of nodes in the octree, including the node headers. 
+ * @return the number of nodes in the output, including the node headers. */
+template<class child_t>
+static uint64_t deduplicate(const basic_octree<child_t> * root, child_t n, octree_format format, const char * filename) {
+  assert(n > 0);
+  dag_builder<child_t> builder(root, n);
+  builder.run();
+  octree_file out(filename, builder.out.size() * sizeof(child_t), format);
+  std::copy(builder.out.begin(), builder.out.end(), reinterpret_cast<child_t *>(out.root));
+  return builder.out.size();
+}
+
+uint64_t octree_deduplicate(const octree_file * in, const char * filename) {
+  if (in->format == OCTREE_FORMAT_COMPACT || in->format == OCTREE_FORMAT_SPLIT) {
+    fprintf(stderr, "Octree files in the compact or split format cannot be deduplicated.\n"); 
+    exit(1);
+  } else if (in->format == OCTREE_FORMAT_WIDE) {
+    return deduplicate(in->nodes<octree64>(), in->size / sizeof(octree64), in->format, filename) * sizeof(octree64);
+  } else {
+    return deduplicate(in->nodes<octree>(), uint32_t(in->size / sizeof(octree)), in->format, filename) * sizeof(octree);
+  }
+}
+
+// kate: space-indent on; indent-width 2; mixedindent off; indent-mode cstyle; 
@@ -19,9 +19,11 @@
 #include <cstdio>
 #include <cassert>
 #include <algorithm>
-#include <smmintrin.h>
+#include <atomic>
+#include <immintrin.h>
 
 #include "quadtree.h"
+#include "threadpool.h"
 #include "timing.h"
 #include "octree.h"
 
@@ -30,11 +32,11 @@
 using std::max;
 using std::min;
 
-static quadtree face;
-static octree * root;
-static int C; //< The corner that is furthest away from the camera.
-static int count, count_oct, count_quad;
-static glm::dvec3 look_dir;
+/** Parallel rendering splits the quadtree into tiles at level TILE_LEVEL.
+ * Each thread traverses the scene for a single tile, using its own copy of the quadtree nodes above the tiles. */
+static const int TILE_LEVEL = 3;
+static const int TILES = 1<<TILE_LEVEL<<TILE_LEVEL;
+static const int TILE_START = (TILES-4)/3; //< Index of the first quadtree node at level TILE_LEVEL.
 
 constexpr static int make_mask(int a, int b, int c, int d) {
     return (a<<0)+(b<<1)+(c<<2)+(d<<3);
@@ -107,6 +109,83 @@ static inline __m128i compute_frustum(__m128i dx, __m128i dy, __m128i dz) {
     return frustum;
 }
 
+/** Evaluates the 8 children of an octree node at once.
+ * The child with index i is stored at position C^i, such that the bound of child c equals
+ * 2*bound + (c&DX?dx:0) + (c&DY?dy:0) + (c&DZ?dz:0), independent of the far corner C.
+ * Each of the structs below implements this for a different instruction set. Their children method
+ * stores the bounds in new_bound[0..7] and returns a bitmask of the children that pass the frustum test.
+ */
+struct children_sse {
+    static inline int children(__m128i bound, __m128i dx, __m128i dy, __m128i dz, __m128i frustum, __m128i * new_bound) {
+        __m128i b0 = _mm_slli_epi32(bound, 1);
+        __m128i b2 = _mm_add_epi32(b0, dy);
+        __m128i b4 = _mm_add_epi32(b0, dx);
+        __m128i b6 = _mm_add_epi32(b4, dy);
+        new_bound[0] = b0;
+        new_bound[1] = _mm_add_epi32(b0, dz);
+        new_bound[2] = b2;
+        new_bound[3] = _mm_add_epi32(b2, dz);
+        new_bound[4] = b4;
+        new_bound[5] = _mm_add_epi32(b4, dz);
+        new_bound[6] = b6;
+        new_bound[7] = _mm_add_epi32(b6, dz);
+        // Pack the comparison results, such that each 32-bit lane corresponds to a single child.
+        __m128i c01 = _mm_packs_epi32(_mm_cmplt_epi32(new_bound[0], frustum), _mm_cmplt_epi32(new_bound[1], frustum));
+        __m128i c23 = _mm_packs_epi32(_mm_cmplt_epi32(new_bound[2], frustum), _mm_cmplt_epi32(new_bound[3], frustum));
+        __m128i c45 = _mm_packs_epi32(_mm_cmplt_epi32(new_bound[4], frustum), _mm_cmplt_epi32(new_bound[5], frustum));
+        __m128i c67 = _mm_packs_epi32(_mm_cmplt_epi32(new_bound[6], frustum), _mm_cmplt_epi32(new_bound[7], frustum));
+        const __m128i nil = _mm_setzero_si128();
+        int lo = movemask_epi32(_mm_cmpeq_epi32(_mm_packs_epi16(c01, c23), nil));
+        int hi = movemask_epi32(_mm_cmpeq_epi32(_mm_packs_epi16(c45, c67), nil));
+        return lo | hi << 4;
+    }
+};
+
+/** Computes the children with the low 128 bit lane holding child c and the high lane child c|DX. */
+struct children_avx2 {
+    __attribute__((target("avx2")))
+    static int children(__m128i bound, __m128i dx, __m128i dy, __m128i dz, __m128i frustum, __m128i * new_bound) {
+        __m256i b0 = _mm256_add_epi32(
+            _mm256_broadcastsi128_si256(_mm_slli_epi32(bound, 1)), 
+            _mm256_inserti128_si256(_mm256_setzero_si256(), dx, 1)
+        );
+        __m256i vdy = _mm256_broadcastsi128_si256(dy);
+        __m256i vdz = _mm256_broadcastsi128_si256(dz);
+        __m256i vfrustum = _mm256_broadcastsi128_si256(frustum);
+        __m256i b1 = _mm256_add_epi32(b0, vdz);
+        __m256i b2 = _mm256_add_epi32(b0, vdy);
+        __m256i b3 = _mm256_add_epi32(b2, vdz);
+        // Store in the order 0..7.
+        _mm256_storeu2_m128i(new_bound+4, new_bound+0, b0);
+        _mm256_storeu2_m128i(new_bound+5, new_bound+1, b1);
+        _mm256_storeu2_m128i(new_bound+6, new_bound+2, b2);
+        _mm256_storeu2_m128i(new_bound+7, new_bound+3, b3);
+        __m256i c01 = _mm256_packs_epi32(_mm256_cmpgt_epi32(vfrustum, b0), _mm256_cmpgt_epi32(vfrustum, b1));
+        __m256i c23 = _mm256_packs_epi32(_mm256_cmpgt_epi32(vfrustum, b2), _mm256_cmpgt_epi32(vfrustum, b3));
+        __m256i c = _mm256_cmpeq_epi32(_mm256_packs_epi16(c01, c23), _mm256_setzero_si256());
+        return _mm256_movemask_ps(_mm256_castsi256_ps(c));
+    }
+};
+
+/** Computes the children 4 at a time, using pext to reduce the 4 comparison bits per child. */
+struct children_avx512 {
+    __attribute__((target("avx512f,bmi2")))
+    static int children(__m128i bound, __m128i dx, __m128i dy, __m128i dz, __m128i frustum, __m128i * new_bound) {
+        // Masked broadcasts place dz in children 1 and 3 and dy in children 2 and 3.
+        __m512i b0 = _mm512_maskz_broadcast_i32x4(0xffff, _mm_slli_epi32(bound, 1));
+        b0 = _mm512_add_epi32(b0, _mm512_maskz_broadcast_i32x4(0xf0f0, dz));
+        b0 = _mm512_add_epi32(b0, _mm512_maskz_broadcast_i32x4(0xff00, dy));
+        __m512i b1 = _mm512_add_epi32(b0, _mm512_maskz_broadcast_i32x4(0xffff, dx));
+        __m512i vfrustum = _mm512_maskz_broadcast_i32x4(0xffff, frustum);
+        _mm512_storeu_si512(new_bound+0, b0);
+        _mm512_storeu_si512(new_bound+4, b1);
+        uint32_t culled = _mm512_cmplt_epi32_mask(b0, vfrustum) | _mm512_cmplt_epi32_mask(b1, vfrustum) << 16;
+        culled |= culled >> 1;
+        culled |= culled >> 2;
+        return ~_pext_u32(culled, 0x11111111) & 0xff;
+    }
+};
+
 #define FOR_i_IS_4_TO_7(code) \
   {constexpr int i = 4; code} \
   {constexpr int i = 5; code} \
@@ -132,121 +211,585 @@ static inline __m128i compute_frustum(__m128i dx, __m128i dy, __m128i dz) {
   {constexpr int k = 5; code} \
   {constexpr int k = 6; code}
 
+/** Returns m with its bits permuted, such that bit j of the result is bit j^x of m. */
+static inline int permute_bits(int m, int x) {
+    if (x&1) m = ((m&0x55)<<1) | ((m>>1)&0x55);
+    if (x&2) m = ((m&0x33)<<2) | ((m>>2)&0x33);
+    if (x&4) m = ((m&0x0f)<<4) | ((m>>4)&0x0f);
+    return m;
+}
+
+/** Computes the bounds of quadtree child i, for a frame storing mid_bound, mid_dx, mid_dy and mid_dz in mid[0..3]. */
+template<int i>
+static inline void quad_child(const __m128i * mid, const __m128i bound, const __m128i dx, const __m128i dy, const __m128i dz, __m128i * out) {
+    constexpr int new_mask = quad_mask[i];
+    out[0] = blend_epi32<new_mask>(mid[0], bound);
+    out[1] = blend_epi32<new_mask>(mid[1], dx);
+    out[2] = blend_epi32<new_mask>(mid[2], dy);
+    out[3] = blend_epi32<new_mask>(mid[3], dz);
+}
+
+/** A pending call of the traversal.
+ * The parameters are documented at octree_traversal::enter. 
+ * The remaining fields store how far the processing of its children has progressed.
+ */
+struct alignas(64) traversal_frame {
+    __m128i bound, dx, dy, dz, frustum, pos;
+    union {
+        __m128i new_bound[8]; //< Bounds of the octree children, see children_sse.
+        __m128i mid[4];       //< mid_bound, mid_dx, mid_dy and mid_dz of the quadtree children.
+    };
+    int32_t quadnode;
+    uint64_t octnode;
+    int32_t depth;
+    int32_t todo;  //< Nonzero bitmask of children that still must be traversed, or -1 if the frame has not been entered.
+    int32_t furthest;
+    bool octree;   //< Whether the children are octree (or duplicated leaf) nodes, rather than quadtree nodes.
+};
+
+/** Octree node references in traversal frames that are at least this value refer to leaves, see child_ref. 
+ * Except for the split format, the lower 32 bits of such a reference are the color of the leaf. */
+static const uint64_t LEAF = uint64_t(1) << 63;
+
+/** Converts an entry of the child array of an octree node into a reference as stored in traversal frames, 
+ * such that nodes of all formats can be traversed using the same frames. */
+static inline uint64_t child_ref(uint32_t child) {
+    return child < octree::COLOR ? child : child | LEAF;
+}
+static inline uint64_t child_ref(uint64_t child) {
+    return child;
+}
+
+/** Returns the reference to the child with the given index (0-7) of the given node, whose reference is ref. */
+template<class child_t>
+static inline uint64_t child_ref(const basic_octree<child_t> & node, uint64_t, int index) {
+    return child_ref(node.child[node.position(index)]);
+}
+static inline uint64_t child_ref(const octree_split & node, uint64_t, int index) {
+    if (node.is_leaf(index)) return (node.color + node.leaf_position(index)) | LEAF;
+    return node.child[node.position(index)];
+}
+static inline uint64_t child_ref(const octree_compact & node, uint64_t ref, int index) {
+    uint32_t pos = node.position(index);
+    if (ref & octree_compact::LEAVES) return node.colors()[pos] | LEAF;
+    uint16_t entry = node.entries()[pos];
+    uint64_t position = (ref >> 1) + (entry >> octree_compact::OFFSET_SHIFT);
+    if (entry & (octree_compact::FAR | octree_compact::COLOR)) {
+        const uint32_t * word = reinterpret_cast<const uint32_t *>(&node) + (entry >> octree_compact::OFFSET_SHIFT);
+        if (entry & octree_compact::COLOR) return word[0] | LEAF;
+        position = word[0] | uint64_t(word[1]) << 32;
+    }
+    return position << 1 | (entry & octree_compact::LEAVES);
+}
+
+/** Returns the level of the given quadnode, where the root (-1) is at level 0. */
+static inline int quad_level(int32_t quadnode) {
+    // Level l starts at index (4^l-4)/3.
+    return (31-__builtin_clz(3*quadnode+4))/2;
+}
+
+/** Computes the position (x,y) of the given quadnode within its level, in units of its size. 
+ * @return the level of the quadnode. */
+static inline int quad_position(int32_t quadnode, uint32_t & x, uint32_t & y) {
+    // Within a level, quadnodes are in Morton order. 
+    int level = quad_level(quadnode);
+    uint32_t v = quadnode - ((1<<level<<level)-4)/3;
+    x = y = 0;
+    for (int i=0; i<level; i++) {
+        x |= (v>>(2*i)&1)<<i;
+        y |= (v>>(2*i+1)&1)<<i;
+    }
+    return level;
+}
+
+/** The maximum number of frames on the stack. 
+ * Octree frames are only created for depth>=0 and quadtree frames for quadnode<M. */
+static const int STACK_SIZE = SCENE_DEPTH + quadtree::MAX_DIM;
+
+/** The state of a single traversal of the scene.
+ * Each thread that renders a tile gets its own copy. 
+ * The traversal is iterative, using an explicit stack of frames. Hence it can be interrupted and resumed later.
+ */
+struct octree_traversal {
+    quadtree * face;
+    const void * root; //< The node array, which consists of nodes of the type given as template argument to traverse.
+    const uint32_t * colors; //< The color array of the split format.
+    glm::dvec3 look_dir;
+    /** The direction of the ray through the center of pixel (x,y) is ray + x*ray_dx + y*ray_dy, 
+     * in octree space and scaled such that its depth along look_dir is 1. */
+    glm::dvec3 ray, ray_dx, ray_dy;
+    /** The array from which the quadtree nodes above the tiles are read, such that top_mask[-1] is the root. */
+    uint8_t * top_mask;
+    int count, count_oct, count_quad;
+    int lod;
+    traversal_frame stack[STACK_SIZE];
+    int top; //< Index of the topmost frame on the stack.
+    
+    /** Returns the quadtree node with the given index. */
+    uint8_t & node(int32_t quadnode) {
+        return (quadnode < TILE_START ? top_mask : face->children)[quadnode];
+    }
+    
+    /** Marks the given quadtree node as rendered, which is propagated to its ancestors. */
+    void complete(int32_t quadnode) {
+        while (quadnode >= 0) {
+            int32_t parent = quadnode/4-1;
+            uint8_t & mask = node(parent);
+            mask &= ~(16<<(quadnode&3));
+            if (mask) return;
+            quadnode = parent;
+        }
+    }
+    
+    /** Returns the octree node with the given reference, which is its index for all formats except the compact format. */
+    template<class octree_node>
+    const octree_node & octnode(uint64_t ref) const {
+        return static_cast<const octree_node *>(root)[ref];
+    }
+    
+    /** Returns the color of the given octree node reference. */
+    template<class octree_node>
+    uint32_t color(uint64_t octnode) const {
+        return octnode < LEAF ? this->octnode<octree_node>(octnode).avgcolor : uint32_t(octnode);
+    }
+    
+    /** Places the initial call of the traversal on the stack. */
+    void start(
+        const int32_t quadnode, const uint64_t octnode,
+        const __m128i bound, const __m128i dx, const __m128i dy, const __m128i dz, const __m128i frustum,
+        const __m128i pos, const int depth
+    ) {
+        traversal_frame & f = stack[0];
+        f.quadnode = quadnode;
+        f.octnode = octnode;
+        f.bound = bound;
+        f.dx = dx;
+        f.dy = dy;
+        f.dz = dz;
+        f.frustum = frustum;
+        f.pos = pos;
+        f.depth = depth;
+        f.todo = -1;
+        top = 0;
+    }
+    
+    template<int C, class simd, class octree_node>
+    inline __attribute__((always_inline)) int enter(traversal_frame & f);
+    
+#ifdef USE_PREFETCH
+    template<class octree_node>
+    void prefetch_children(uint64_t octnode, int todo, int furthest);
+#endif
+    bool covers(traversal_frame & f);
+    template<class octree_node>
+    bool draw_leaves(traversal_frame & f, uint8_t & mask);
+    template<class octree_node>
+    void fill(traversal_frame & f);
+    template<class octree_node>
+    void fill_solid(traversal_frame & f);
+    template<class depth_function>
+    void fill(int32_t quadnode, uint32_t x, uint32_t y, uint32_t size, uint32_t color, depth_function depth);
+    /** Draws all pixels of the given quadnode, whose top left pixel is (x,y), that are not yet rendered, at the given depth. */
+    void fill(int32_t quadnode, uint32_t x, uint32_t y, uint32_t size, uint32_t color, uint32_t depth) {
+        fill(quadnode, x, y, size, color, [depth](uint32_t, uint32_t) { return depth; });
+    }
+    
+    template<int C, class simd, class octree_node>
+    bool traverse(int steps);
+};
+
+template<>
+inline const octree_compact & octree_traversal::octnode<octree_compact>(uint64_t ref) const {
+    return static_cast<const octree_compact *>(root)[ref >> 1];
+}
+
+template<>
+inline const octree_split & octree_traversal::octnode<octree_split>(uint64_t ref) const {
+    return *reinterpret_cast<const octree_split *>(static_cast<const uint32_t *>(root) + ref);
+}
+
+/** The split format stores the colors separately, such that these are only read when drawing. */
+template<>
+inline uint32_t octree_traversal::color<octree_split>(uint64_t octnode) const {
+    return colors[octnode < LEAF ? this->octnode<octree_split>(octnode).color : octnode & ~LEAF];
+}
+
+#ifdef USE_PREFETCH
+/** Prefetches the children of the given octree node, such that bit k of todo selects child furthest^k. 
+ * This is done for all children that will be traversed before traversing the first, 
+ * such that the memory latency of loading them overlaps. */
+template<class octree_node>
+inline void octree_traversal::prefetch_children(uint64_t ref, int todo, int furthest) {
+    const octree_node & parent = octnode<octree_node>(ref);
+    for (; todo; todo &= todo-1) {
+        uint64_t child = child_ref(parent, ref, __builtin_ctz(todo) ^ furthest);
+        if (child < LEAF) _mm_prefetch((const char*)&octnode<octree_node>(child), _MM_HINT_T0);
+    }
+}
+#endif
+
 /** Core of the voxel rendering algorithm.
- * @param quadnode the index of the quadnode that will be rendered to. It is assumed that it is not yet fully rendered.
- * @param octnode the index of the current octree node that is being rendered. For leaf nodes (and their 'childs') octnode will be a color and >= 0xff000000u.
- * @param bound is the quadnode projected on the parallel plane containing the furthest corner of the current octree node.
- *              It stores the distance from this furthest corner to the (left, right, top, bottom) edge of the projected quadnode.
- * @param dx,dy,dz represent how this projection changes when traversing an edge to one of the other corners.
- * @param frustum equal to `compute_frustum(dx,dy,dz)`, a magic variable used for frustum occlusion.
- * @param pos is the location of the center of the octree node, relative to the viewer in octree space.
- * @param depth limits the number of nested traverse calls, to prevent stack overflows.
- * @return true if quadtree node is rendered 
+ * Determines which children must be traversed for the given frame, which has its parameters set as follows:
+ * - quadnode the index of the quadnode that will be rendered to. It is assumed that it is not yet fully rendered.
+ * - octnode the reference to the current octree node that is being rendered. For leaf nodes (and their 'childs') octnode refers to a color and is >= LEAF.
+ * - bound is the quadnode projected on the parallel plane containing the furthest corner of the current octree node.
+ *         It stores the distance from this furthest corner to the (left, right, top, bottom) edge of the projected quadnode.
+ * - dx,dy,dz represent how this projection changes when traversing an edge to one of the other corners.
+ * - frustum equal to `compute_frustum(dx,dy,dz)`, a magic variable used for frustum occlusion.
+ * - pos is the location of the center of the octree node, relative to the viewer in octree space.
+ * - depth limits the number of nested octree frames, such that the stack cannot overflow.
+ * When the quadnode's children are leaves, these are drawn immediately.
+ * @tparam C the corner that is furthest away from the camera. This is fixed during a frame.
+ * @tparam simd one of the children_* structs, used to evaluate the children of an octree node.
+ * @tparam octree_node the type of the octree nodes, which depends on the format of the octree file.
+ * @return 1 if the frame has children left to traverse, 0 if it has not, 
+ *         and -1 if its quadnode (and possibly some of its ancestors) became fully rendered.
  */
-static bool traverse(
-    const int32_t quadnode, const uint32_t octnode,
-    const __m128i bound, const __m128i dx, const __m128i dy, const __m128i dz, const __m128i frustum,
-    const __m128i pos, const int depth
-){    
+template<int C, class simd, class octree_node>
+int octree_traversal::enter(traversal_frame & f) {
     count++;
     // Recursion
-    int delta = extract_epi32<0>(_mm_add_epi32(bound,_mm_srli_si128(bound,4)));
-    if (depth>=0 && delta < 2<<SCENE_DEPTH) {
-        __m128i octant = _mm_cmplt_epi32(pos, _mm_setzero_si128());
+    int delta = extract_epi32<0>(_mm_add_epi32(f.bound,_mm_srli_si128(f.bound,4)));
+    if (f.depth>=0 && delta < 2<<SCENE_DEPTH) {
+        __m128i octant = _mm_cmplt_epi32(f.pos, _mm_setzero_si128());
         int furthest = movemask_epi32(_mm_shuffle_epi32(octant, 0xc6));
-        if (octnode < 0xff000000) {
-            // Traverse octree
-            FOR_k_IS_0_TO_7({
-                int i = furthest^k;
-                if (root[octnode].has_index(i)) {
-                    int j = root[octnode].position(i);
-                    __m128i new_bound = _mm_slli_epi32(bound, 1);
-                    if ((C^i)&DX) new_bound = _mm_add_epi32(new_bound,dx);
-                    if ((C^i)&DY) new_bound = _mm_add_epi32(new_bound,dy);
-                    if ((C^i)&DZ) new_bound = _mm_add_epi32(new_bound,dz);
-                    if (!movemask_epi32(_mm_cmplt_epi32(new_bound, frustum))) { // frustum occlusion
-                        count_oct++;
-                        if (traverse(quadnode, root[octnode].child[j], new_bound, dx, dy, dz, frustum, _mm_add_epi32(pos, _mm_slli_epi32(DELTA[i], depth)), depth-1)) return true;
-                    }
-                }
-            });
-        } else {
-            // Duplicate leaf node
-            FOR_k_IS_0_TO_6({
-                int i = furthest^k;
-                __m128i new_bound = _mm_slli_epi32(bound, 1);
-                if ((C^i)&DX) new_bound = _mm_add_epi32(new_bound,dx);
-                if ((C^i)&DY) new_bound = _mm_add_epi32(new_bound,dy);
-                if ((C^i)&DZ) new_bound = _mm_add_epi32(new_bound,dz);
-                if (!movemask_epi32(_mm_cmplt_epi32(new_bound, frustum))) { // frustum occlusion
-                    count_oct++;
-                    if (traverse(quadnode, octnode, new_bound, dx, dy, dz, frustum, _mm_add_epi32(pos, _mm_slli_epi32(DELTA[i], depth)), depth-1)) return true;
-                }
-            });
+        if (lod) {
+            // The quadnode is SIZE>>level pixels wide, and delta wide when projected onto the octree node.
+            if ((int64_t(2<<SCENE_DEPTH)<<face->dim>>quad_level(f.quadnode)) < int64_t(lod)*delta) {
+                // The octree node is too small to be worth refining, hence it is assumed to cover the quadnode.
+                fill<octree_node>(f);
+                return -1;
+            }
+        }
+        if (f.octnode >= LEAF && f.quadnode < face->M && covers(f)) {
+            // The leaf is solid, hence drawing it to every pixel of the quadnode gives the same colors as subdividing it.
+            fill_solid<octree_node>(f);
+            return -1;
         }
-        return false;
+        int visible = simd::children(f.bound, f.dx, f.dy, f.dz, f.frustum, f.new_bound); // frustum occlusion
+        // Children are traversed front to back, such that child furthest^k is at bit k of todo.
+        // Duplicate leaf nodes have 7 virtual children, omitting the one nearest to the camera.
+        int present = f.octnode < LEAF ? permute_bits(octnode<octree_node>(f.octnode).bitmask, furthest) : 0x7f;
+        f.todo = present & permute_bits(visible, C^furthest);
+#ifdef USE_PREFETCH
+        if (f.octnode < LEAF) prefetch_children<octree_node>(f.octnode, f.todo, furthest);
+#endif
+        f.furthest = furthest;
+        f.octree = true;
+        return f.todo != 0;
     } else {
         // Traverse quadtree 
-        int mask = face.children[quadnode];
-        __m128i mid_bound = _mm_srai_epi32(_mm_sub_epi32(bound, _mm_shuffle_epi32(bound,0xb1)), 1);
-        __m128i mid_dx = _mm_srai_epi32(_mm_sub_epi32(dx, _mm_shuffle_epi32(dx,0xb1)), 1);
-        __m128i mid_dy = _mm_srai_epi32(_mm_sub_epi32(dy, _mm_shuffle_epi32(dy,0xb1)), 1);
-        __m128i mid_dz = _mm_srai_epi32(_mm_sub_epi32(dz, _mm_shuffle_epi32(dz,0xb1)), 1);
-        FOR_i_IS_4_TO_7({ // Using a fixed size loop as blend_epi32 requires a compile-time constant as mask.
-            if (mask&(1<<i)) {
-                constexpr int new_mask = quad_mask[i];
-                __m128i new_bound = blend_epi32<new_mask>(mid_bound, bound);
-                __m128i new_dx = blend_epi32<new_mask>(mid_dx, dx);
-                __m128i new_dy = blend_epi32<new_mask>(mid_dy, dy);
-                __m128i new_dz = blend_epi32<new_mask>(mid_dz, dz);
-                __m128i new_frustum = compute_frustum(new_dx, new_dy, new_dz);
-                if (!movemask_epi32(_mm_cmplt_epi32(new_bound, new_frustum))) { // frustum occlusion
-                    if (quadnode<quadtree::M) {
-                        if (traverse(quadnode*4+i, octnode, new_bound, new_dx, new_dy, new_dz, new_frustum, pos, depth)) {
-                            mask &= ~(1<<i); 
-                        }
-                        count_quad++;
-                    } else {
-                        glm::dvec3 dpos(extract_epi32<0>(pos), extract_epi32<1>(pos), extract_epi32<2>(pos));
-                        double depth = glm::dot(dpos, look_dir);
-                        uint32_t udepth(depth);
-                        uint32_t color = (octnode < 0xff000000u) ? root[octnode].avgcolor : octnode;
-                        face.draw(quadnode*4+i, color, udepth); // Rendering
-                        mask &= ~(1<<i);
-                    }
-                }
+        uint8_t & mask = node(f.quadnode);
+        f.mid[0] = _mm_srai_epi32(_mm_sub_epi32(f.bound, _mm_shuffle_epi32(f.bound,0xb1)), 1);
+        f.mid[1] = _mm_srai_epi32(_mm_sub_epi32(f.dx, _mm_shuffle_epi32(f.dx,0xb1)), 1);
+        f.mid[2] = _mm_srai_epi32(_mm_sub_epi32(f.dy, _mm_shuffle_epi32(f.dy,0xb1)), 1);
+        f.mid[3] = _mm_srai_epi32(_mm_sub_epi32(f.dz, _mm_shuffle_epi32(f.dz,0xb1)), 1);
+        if (f.quadnode<face->M) {
+            f.todo = mask & 0xf0;
+            f.octree = false;
+            return 1;
+        }
+        return draw_leaves<octree_node>(f, mask) ? -1 : 0;
+    }
+}
+
+/** Checks whether the ray on which lanes a and b of the given bounds are zero passes through the octree node.
+ * The lanes of its corners are bound + i*dx + j*dy + k*dz for i,j,k in {0,1}, which for lanes a and b form a hexagon.
+ * The ray passes through the node if this hexagon contains the origin, which is tested against each pair of its edges. */
+static inline bool ray_hits_node(const int32_t * bound, const int32_t * dx, const int32_t * dy, const int32_t * dz, int a, int b) {
+    // Doubles are used, as the cross products do not fit in 64 bit integers. Rounding only affects grazing rays.
+    const double g[3][2] = {{double(dx[a]), double(dx[b])}, {double(dy[a]), double(dy[b])}, {double(dz[a]), double(dz[b])}};
+    const double center[2] = {2.0*bound[a] + g[0][0] + g[1][0] + g[2][0], 2.0*bound[b] + g[0][1] + g[1][1] + g[2][1]};
+    for (int i=0; i<3; i++) {
+        double extent = 0;
+        for (int j=0; j<3; j++) {
+            extent += std::fabs(g[i][0]*g[j][1] - g[i][1]*g[j][0]);
+        }
+        if (std::fabs(g[i][0]*center[1] - g[i][1]*center[0]) >= extent) return false;
+    }
+    return true;
+}
+
+/** Checks whether the octree node of the given frame covers every pixel of its quadnode, 
+ * that is, whether every ray through the quadnode passes through the octree node. 
+ * As the node is convex, it suffices to check the rays through the 4 corners of the quadnode. */
+bool octree_traversal::covers(traversal_frame & f) {
+    // Each edge of the quadnode must lie partially inside the node, hence the node must extend beyond each edge.
+    __m128i nearest = _mm_add_epi32(_mm_add_epi32(f.bound, f.frustum), _mm_add_epi32(_mm_add_epi32(f.dx, f.dy), f.dz));
+    if (movemask_epi32(_mm_cmpgt_epi32(nearest, _mm_set1_epi32(-1)))) return false;
+    // Rays behind the camera also have their lanes zero, hence the node must be in front of the camera.
+    glm::dvec3 dpos(extract_epi32<0>(f.pos), extract_epi32<1>(f.pos), extract_epi32<2>(f.pos));
+    if (glm::dot(dpos, look_dir) <= double(4<<f.depth)) return false;
+    int32_t bound[4], dx[4], dy[4], dz[4];
+    _mm_storeu_si128((__m128i*)bound, f.bound);
+    _mm_storeu_si128((__m128i*)dx, f.dx);
+    _mm_storeu_si128((__m128i*)dy, f.dy);
+    _mm_storeu_si128((__m128i*)dz, f.dz);
+    return 
+        ray_hits_node(bound, dx, dy, dz, 0, 2) && ray_hits_node(bound, dx, dy, dz, 0, 3) &&
+        ray_hits_node(bound, dx, dy, dz, 1, 2) && ray_hits_node(bound, dx, dy, dz, 1, 3);
+}
+
+/** Draws the children of a quadnode at the bottom level of the quadtree. 
+ * @return true if the quadnode became fully rendered. */
+template<class octree_node>
+bool octree_traversal::draw_leaves(traversal_frame & f, uint8_t & mask) {
+    int new_mask = mask;
+    FOR_i_IS_4_TO_7({ // Using a fixed size loop as blend_epi32 requires a compile-time constant as mask.
+        if (new_mask&(1<<i)) {
+            __m128i child[4];
+            quad_child<i>(f.mid, f.bound, f.dx, f.dy, f.dz, child);
+            __m128i new_frustum = compute_frustum(child[1], child[2], child[3]);
+            if (!movemask_epi32(_mm_cmplt_epi32(child[0], new_frustum))) { // frustum occlusion
+                glm::dvec3 dpos(extract_epi32<0>(f.pos), extract_epi32<1>(f.pos), extract_epi32<2>(f.pos));
+                double depth = glm::dot(dpos, look_dir);
+                uint32_t udepth(depth);
+                face->draw(f.quadnode*4+i, color<octree_node>(f.octnode), udepth); // Rendering
+                new_mask &= ~(1<<i);
             }
-        });
-        face.children[quadnode] = mask;
-        return mask == 0;
+        }
+    });
+    mask = new_mask;
+    if (new_mask) return false;
+    complete(f.quadnode);
+    return true;
+}
+
+/** Draws the octree node of the given frame to all pixels of its quadnode that are not yet rendered. */
+template<class octree_node>
+void octree_traversal::fill(traversal_frame & f) {
+    glm::dvec3 dpos(extract_epi32<0>(f.pos), extract_epi32<1>(f.pos), extract_epi32<2>(f.pos));
+    double depth = glm::dot(dpos, look_dir);
+    uint32_t x, y;
+    int level = quad_position(f.quadnode, x, y);
+    uint32_t size = face->SIZE>>level;
+    fill(f.quadnode, x*size, y*size, size, color<octree_node>(f.octnode), uint32_t(depth));
+    complete(f.quadnode);
+}
+
+/** Draws the leaf of the given frame, which covers its quadnode, to all pixels of the quadnode that are not yet rendered. 
+ * The depth of each pixel is where the ray through it enters the leaf, which is found as the furthest of the planes 
+ * containing the faces of the leaf that point towards the camera. */
+template<class octree_node>
+void octree_traversal::fill_solid(traversal_frame & f) {
+    double half = 2<<f.depth; //< Half the width of the leaf.
+    int32_t pos[4];
+    _mm_storeu_si128((__m128i*)pos, f.pos);
+    double face_pos[3];
+    for (int i=0; i<3; i++) {
+        // The camera is between the planes of both faces orthogonal to axis i if |pos| <= half, and these do not bound the depth.
+        face_pos[i] = pos[i] > half ? pos[i] - half : pos[i] < -half ? pos[i] + half : 0;
+    }
+    uint32_t x, y;
+    int level = quad_position(f.quadnode, x, y);
+    uint32_t size = face->SIZE>>level;
+    fill(f.quadnode, x*size, y*size, size, color<octree_node>(f.octnode), [&](uint32_t px, uint32_t py) {
+        glm::dvec3 dir = ray + double(px)*ray_dx + double(py)*ray_dy;
+        double depth = 0;
+        for (int i=0; i<3; i++) {
+            if (face_pos[i] != 0) depth = max(depth, face_pos[i] / dir[i]);
+        }
+        return uint32_t(min(depth, 4294967295.0));
+    });
+    complete(f.quadnode);
+}
+
+/** Draws all pixels of the given quadnode, whose top left pixel is (x,y), that are not yet rendered. 
+ * The depth of pixel (px,py) is given by depth(px,py). */
+template<class depth_function>
+void octree_traversal::fill(int32_t quadnode, uint32_t x, uint32_t y, uint32_t size, uint32_t color, depth_function depth) {
+    uint8_t & mask = node(quadnode);
+    uint32_t m = mask;
+    mask = 0;
+    size /= 2;
+    if (quadnode<face->M) {
+        for (int i=4; i<8; i++) {
+            if (m&(1<<i)) fill(quadnode*4+i, x + (i&1)*size, y + (i>>1&1)*size, size, color, depth);
+        }
+    } else if (face->morton_data) {
+        // The children are pixels, which are stored consecutively.
+        uint32_t offset = quadnode*4+4 - face->N;
+        for (int i=0; i<4; i++) {
+            if (m&(16<<i)) {
+                face->morton_data[offset+i] = color;
+                face->morton_depth[offset+i] = depth(x + (i&1), y + (i>>1&1));
+            }
+        }
+    } else {
+        // The children are pixels.
+        uint32_t * data = face->surf.data + x + y*int64_t(face->surf.width);
+        uint32_t * zbuf = face->surf.depth ? face->surf.depth + (data - face->surf.data) : nullptr;
+        int64_t offset[4] = {0, 1, face->surf.width, face->surf.width+1};
+        for (int i=4; i<8; i++) {
+            if (m&(1<<i)) {
+                data[offset[i&3]] = color;
+                if (zbuf) zbuf[offset[i&3]] = depth(x + (i&1), y + (i>>1&1));
+            }
+        }
     }
 }
 
-/** Render the octree to the provided surface for the given viewpane, position and orientation.
- * @param file the octree that is being rendered.
- * @param surf the surface that is being rendered to.
- * @param position the position of the camera.
- * @param orientation the orientation of the camera (which is assumed to be orthogonal).
+/** Continues the traversal for at most the given number of steps.
+ * Each step traverses into one child of the topmost frame on the stack. 
+ * @return true if the traversal has finished.
  */
-void octree_draw(octree_file* file, surface surf, view_pane view, glm::dvec3 position, glm::dmat3 orientation) {
+template<int C, class simd, class octree_node>
+bool octree_traversal::traverse(int steps) {
+    int top = this->top;
+    if (top >= 0 && stack[top].todo < 0) {
+        // Enter the initial frame as if it were the child of an empty stack.
+        top = enter<C,simd,octree_node>(stack[0]) > 0 ? 0 : -1;
+    }
+    for (; top >= 0 && steps > 0; steps--) {
+        traversal_frame & f = stack[top];
+        int i = __builtin_ctz(f.todo);
+        f.todo &= f.todo-1;
+        // The last child replaces its parent on the stack. 
+        // Hence c and f can be the same frame, so each field of f must be read before it is overwritten.
+        if (f.todo == 0) top--;
+        assert(top+1 < STACK_SIZE);
+        traversal_frame & c = stack[top+1];
+        if (f.octree) {
+            // Traverse octree
+            i ^= f.furthest;
+            count_oct++;
+            c.quadnode = f.quadnode;
+            if (f.octnode < LEAF) {
+                const octree_node & parent = octnode<octree_node>(f.octnode);
+                c.octnode = child_ref(parent, f.octnode, i);
+            } else {
+                c.octnode = f.octnode;
+            }
+            c.bound = f.new_bound[C^i];
+            c.dx = f.dx;
+            c.dy = f.dy;
+            c.dz = f.dz;
+            c.frustum = f.frustum;
+            c.pos = _mm_add_epi32(f.pos, _mm_slli_epi32(DELTA[i], f.depth));
+            c.depth = f.depth-1;
+        } else {
+            // Traverse quadtree
+            __m128i child[4];
+            switch (i) {
+                case 4: quad_child<4>(f.mid, f.bound, f.dx, f.dy, f.dz, child); break;
+                case 5: quad_child<5>(f.mid, f.bound, f.dx, f.dy, f.dz, child); break;
+                case 6: quad_child<6>(f.mid, f.bound, f.dx, f.dy, f.dz, child); break;
+                default: quad_child<7>(f.mid, f.bound, f.dx, f.dy, f.dz, child); break;
+            }
+            __m128i new_frustum = compute_frustum(child[1], child[2], child[3]);
+            if (movemask_epi32(_mm_cmplt_epi32(child[0], new_frustum))) continue; // frustum occlusion
+            count_quad++;
+            c.quadnode = f.quadnode*4+i;
+            c.octnode = f.octnode;
+            c.bound = child[0];
+            c.dx = child[1];
+            c.dy = child[2];
+            c.dz = child[3];
+            c.frustum = new_frustum;
+            c.pos = f.pos;
+            c.depth = f.depth;
+        }
+        int r = enter<C,simd,octree_node>(c);
+        if (r > 0) {
+            top++;
+        } else if (r < 0) {
+            // The quadnodes of the frames on the stack form a chain of descendants. Hence the frames 
+            // for the nodes that are now fully rendered are on top of the stack, and these are dropped.
+            while (top >= 0 && node(stack[top].quadnode) == 0) top--;
+        }
+    }
+    this->top = top;
+    return top < 0;
+}
+
+typedef bool (octree_traversal::*traverse_function)(int);
+
+/** Number of steps that the traversal takes between checks of the time budget. */
+static const int BUDGET_STEPS = 1024;
+
+/** Runs the traversal until it has finished. 
+ * If the given timer exceeds the budget, the remainder is rendered at the coarsest level of detail. */
+static void run_traversal(octree_traversal & state, traverse_function traverse, Timer & timer, double budget) {
+    if (budget <= 0) {
+        (state.*traverse)(INT_MAX);
+        return;
+    }
+    while (!(state.*traverse)(BUDGET_STEPS)) {
+        if (timer.elapsed() > budget) {
+            // Any octree node that is larger than its quadnode now fills that quadnode.
+            state.lod = INT_MAX;
+        }
+    }
+}
+
+/** Returns the traversal functions for each value of the far corner C. */
+template<class simd, class octree_node>
+static const traverse_function * traverse_table() {
+    static const traverse_function table[8] = {
+        &octree_traversal::traverse<0,simd,octree_node>,
+        &octree_traversal::traverse<1,simd,octree_node>,
+        &octree_traversal::traverse<2,simd,octree_node>,
+        &octree_traversal::traverse<3,simd,octree_node>,
+        &octree_traversal::traverse<4,simd,octree_node>,
+        &octree_traversal::traverse<5,simd,octree_node>,
+        &octree_traversal::traverse<6,simd,octree_node>,
+        &octree_traversal::traverse<7,simd,octree_node>,
+    };
+    return table;
+}
+
+/** Selects the traversal of the given node type for the widest instruction set supported by the cpu. */
+template<class octree_node>
+static const traverse_function * select_traverse() {
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("bmi2")) {
+        return traverse_table<children_avx512,octree_node>();
+    } else if (__builtin_cpu_supports("avx2")) {
+        return traverse_table<children_avx2,octree_node>();
+    } else {
+        return traverse_table<children_sse,octree_node>();
+    }
+}
+
+octree_renderer::octree_renderer(int threads) : count(0), count_oct(0), count_quad(0), lod(0), budget(0), fill_background(false), background(0), face(new quadtree()), pool(nullptr), budget_lod(0) {
+    set_threads(threads);
+}
+
+octree_renderer::~octree_renderer() {
+    delete pool;
+    delete face;
+}
+
+void octree_renderer::set_threads(int threads) {
+    delete pool;
+    pool = threads > 1 ? new threadpool(threads) : nullptr;
+}
+
+void octree_renderer::set_deferred(bool enabled) {
+    face->set_deferred(enabled);
+}
+
+void octree_renderer::set_scissor(uint32_t x0, uint32_t y0, uint32_t x1, uint32_t y1) {
+    face->set_scissor(x0, y0, x1, y1);
+}
+
+void octree_renderer::draw(octree_file* file, surface surf, view_pane view, glm::dvec3 position, glm::dmat3 orientation) {
     Timer t_global;
     
     double timer_prepare;
     double timer_query;
     
     // Make sure that the quadtree is big enough that it can contain the rendered surface.
-    // If these checks fail, increase quadtree::dim in quadtree.h.
-    assert(quadtree::SIZE >= surf.width);
-    assert(quadtree::SIZE >= surf.height);
+    face->resize(surf.width, surf.height);
     
     double quadtree_bounds[] = {
         view.left,
-       (view.left + (view.right -view.left)*(double)quadtree::SIZE/surf.width ),
-       (view.top  + (view.bottom-view.top )*(double)quadtree::SIZE/surf.height),
+       (view.left + (view.right -view.left)*(double)face->SIZE/surf.width ),
+       (view.top  + (view.bottom-view.top )*(double)face->SIZE/surf.height),
         view.top,
     };
-    // On the other hand, if quadtree::dim is too high, it can cause an overflow in the computation of bounds[].
-    // If these checks fail, decrease quadtree::dim in quadtree.h.
+    // On the other hand, if the quadtree is much larger than the surface, it can cause an overflow in the computation of bounds[].
+    // As the quadtree is at most twice as large, these checks can only fail for extremely wide view panes.
 #ifndef NDEBUG
     int overflow_limit = 0x3fffffff >> SCENE_DEPTH;
     for (int i=0; i<4; i++) {
@@ -254,20 +797,32 @@ void octree_draw(octree_file* file, surface surf, view_pane view, glm::dvec3 pos
     }
 #endif
 
-    root = file->root;
-    face.surf = surf;
-    look_dir = glm::dvec3(0,0,1) * orientation;
+    octree_traversal state;
+    state.face = face;
+    state.root = file->root;
+    state.colors = file->format == OCTREE_FORMAT_SPLIT ? file->nodes<uint32_t>() + file->header()->colors : nullptr;
+    state.look_dir = glm::dvec3(0,0,1) * orientation;
+    double pixel_width  = (quadtree_bounds[1] - quadtree_bounds[0]) / face->SIZE;
+    double pixel_height = (quadtree_bounds[2] - quadtree_bounds[3]) / face->SIZE;
+    state.ray = glm::dvec3(quadtree_bounds[0] + pixel_width/2, quadtree_bounds[3] + pixel_height/2, 1) * orientation;
+    state.ray_dx = glm::dvec3(pixel_width, 0, 0) * orientation;
+    state.ray_dy = glm::dvec3(0, pixel_height, 0) * orientation;
+    state.top_mask = face->children;
+    state.count_oct = state.count_quad = state.count = 0;
+    state.lod = std::max(lod, budget_lod);
+    face->surf = surf;
     
     Timer t_prepare;
     // Prepare the occlusion quadtree
-    face.build();
+    face->build();
     timer_prepare = t_prepare.elapsed();
 
     Timer t_query;
-    count_oct = count_quad = count = 0;
+    double query_budget = budget > 0 ? std::max(budget - timer_prepare, 0.001) : 0;
     // Do the actual rendering of the scene (i.e. execute the query).
     __m128i bounds[8];
     int max_z = INT_MIN;
+    int C = 0; //< The corner that is furthest away from the camera.
     for (int i=0; i<8; i++) {
         // Compute position of octree corners in camera-space
         __m128i vert = _mm_slli_epi32(DELTA[i], SCENE_DEPTH);
@@ -289,10 +844,119 @@ void octree_draw(octree_file* file, surface surf, view_pane view, glm::dvec3 pos
     __m128i new_dy = _mm_sub_epi32(bounds[C^DY], bounds[C]);
     __m128i new_dz = _mm_sub_epi32(bounds[C^DZ], bounds[C]);
     __m128i new_frustum = compute_frustum(new_dx, new_dy, new_dz);
-    traverse(-1, 0, bounds[C], new_dx, new_dy, new_dz, new_frustum, pos, SCENE_DEPTH-1);
+    static const traverse_function * traverse_oc2 = select_traverse<octree>();
+    static const traverse_function * traverse_wide = select_traverse<octree64>();
+    static const traverse_function * traverse_compact = select_traverse<octree_compact>();
+    static const traverse_function * traverse_split = select_traverse<octree_split>();
+    // Select the traversal for the file's node type and this frame's far corner.
+    traverse_function traverse = (
+        file->format == OCTREE_FORMAT_WIDE ? traverse_wide : 
+        file->format == OCTREE_FORMAT_COMPACT ? traverse_compact : 
+        file->format == OCTREE_FORMAT_SPLIT ? traverse_split : traverse_oc2
+    )[C];
+    uint64_t root_ref = file->header() ? file->header()->root : 0;
+    if (pool) {
+        std::atomic<int> sum_count(0), sum_count_oct(0), sum_count_quad(0);
+        pool->run(TILES, [&](int t) {
+            int tile = TILE_START + t;
+            if (!(face->children[tile/4-1] & (16<<(tile&3)))) return; // Tile is outside the surface.
+            // Restrict the nodes above the tile, such that the traversal only enters this tile.
+            // Any tile is then rendered with the exact same sequence of calls as in the single threaded case.
+            uint8_t mask[TILE_START+1] = {0};
+            for (int q = tile; q >= 0; q = q/4-1) {
+                mask[q/4] |= 16<<(q&3);
+            }
+            octree_traversal tile_state(state);
+            tile_state.top_mask = mask + 1;
+            tile_state.start(-1, root_ref, bounds[C], new_dx, new_dy, new_dz, new_frustum, pos, SCENE_DEPTH-1);
+            run_traversal(tile_state, traverse, t_query, query_budget);
+            if (fill_background) {
+                uint32_t x, y;
+                uint32_t size = face->SIZE >> quad_position(tile, x, y);
+                tile_state.fill(tile, x*size, y*size, size, background, ~0u);
+            }
+            sum_count += tile_state.count;
+            sum_count_oct += tile_state.count_oct;
+            sum_count_quad += tile_state.count_quad;
+        });
+        // Bring the nodes above the tiles up to date.
+        for (int q = TILE_START-1; q >= -1; q--) {
+            uint8_t & node = face->children[q];
+            for (int i=4; i<8; i++) {
+                if (!face->children[q*4+i]) node &= ~(1<<i);
+            }
+        }
+        count = sum_count;
+        count_oct = sum_count_oct;
+        count_quad = sum_count_quad;
+    } else {
+        state.start(-1, root_ref, bounds[C], new_dx, new_dy, new_dz, new_frustum, pos, SCENE_DEPTH-1);
+        run_traversal(state, traverse, t_query, query_budget);
+        if (fill_background) state.fill(-1, 0, 0, face->SIZE, background, ~0u);
+        count = state.count;
+        count_oct = state.count_oct;
+        count_quad = state.count_quad;
+    }
+    if (face->morton_data) {
+        // Copy the drawn pixels to the surface, in strips of rows.
+        if (pool) {
+            uint32_t rows = ((surf.height + TILES - 1) / TILES + 1) & ~1;
+            pool->run(TILES, [&](int i) {
+                // Strips start at even rows, as resolve copies pairs of rows. Strips below the surface are skipped.
+                if (i*rows < surf.height) face->resolve(i*rows, std::min((i+1)*rows, surf.height));
+            });
+        } else {
+            face->resolve(0, surf.height);
+        }
+    }
     timer_query = t_query.elapsed();
+    
+    // Adapt the level of detail for the next frame to the time budget. 
+    // Cutoffs below 3 pixels have no effect, hence these are skipped.
+    if (budget <= 0) {
+        budget_lod = 0;
+    } else if (timer_query > 0.8 * query_budget) {
+        budget_lod = budget_lod < 3 ? 3 : std::min(budget_lod + 1, (int)face->SIZE);
+    } else if (timer_query < 0.5 * query_budget) {
+        budget_lod = budget_lod > 3 ? budget_lod - 1 : 0;
+    }
 
     std::printf("%7.2f | Prepare:%4.2f Query:%7.2f | Count:%10d Oct:%10d Quad:%10d\n", t_global.elapsed(), timer_prepare, timer_query, count, count_oct, count_quad);
 }
 
+/** The renderer used by octree_draw. */
+static octree_renderer & default_renderer() {
+    static octree_renderer renderer;
+    return renderer;
+}
+
+void octree_draw(octree_file* file, surface surf, view_pane view, glm::dvec3 position, glm::dmat3 orientation) {
+    default_renderer().draw(file, surf, view, position, orientation);
+}
+
+void octree_set_threads(int threads) {
+    default_renderer().set_threads(threads);
+}
+
+void octree_set_lod(int pixels) {
+    default_renderer().lod = pixels;
+}
+
+void octree_set_budget(double milliseconds) {
+    default_renderer().budget = milliseconds;
+}
+
+void octree_set_background(bool enabled, uint32_t color) {
+    default_renderer().fill_background = enabled;
+    default_renderer().background = color;
+}
+
+void octree_set_deferred(bool enabled) {
+    default_renderer().set_deferred(enabled);
+}
+
+void octree_set_scissor(uint32_t x0, uint32_t y0, uint32_t x1, uint32_t y1) {
+    default_renderer().set_scissor(x0, y0, x1, y1);
+}
+
 // kate: space-indent on; indent-width 4; mixedindent off; indent-mode cstyle; 
@@ -19,6 +19,7 @@
 #include <cstdio>
 #include <cstdlib>
 #include <cassert>
+#include <algorithm>
 #include <fcntl.h>
 #include <unistd.h>
 #include <sys/mman.h>
@@ -27,31 +28,57 @@
 
 #define static_assert(test, message) typedef char static_assert__##message[(test)?1:-1]
 static_assert(sizeof(octree)==4,octree_wrong_size);
+static_assert(sizeof(octree64)==8,octree64_wrong_size);
+static_assert(sizeof(octree_compact)==4,octree_compact_wrong_size);
+static_assert(sizeof(octree_split)==8,octree_split_wrong_size);
+static_assert(sizeof(octree_header)==24,octree_header_wrong_size);
 
-octree_file::octree_file(const char* filename) : write(false) {
+/** Returns the size of the nodes of the given format. Only used by assertions. */
+__attribute__((unused)) static uint64_t node_size(octree_format format) {
+  // The split format consists of arrays of 4 byte words.
+  return format == OCTREE_FORMAT_WIDE ? sizeof(octree64) : format == OCTREE_FORMAT_OC2 ? sizeof(octree) : 4;
+}
+
+octree_file::octree_file(const char* filename) : write(false), format(OCTREE_FORMAT_OC2) {
   fd = open(filename, O_RDONLY);
   if (fd == -1) {perror("Could not open file"); exit(1);}
-  size = lseek(fd, 0, SEEK_END);
-  assert(size % sizeof(octree) == 0);
+  uint64_t filesize = lseek(fd, 0, SEEK_END);
+  // Files that start with the magic number have a header, other files are in the OC2 format.
+  octree_header header;
+  if (filesize >= sizeof(header) && pread(fd, &header, sizeof(header), 0) == sizeof(header) && 
+      std::equal(header.magic, header.magic + 4, OCTREE_MAGIC)) {
+    if (header.format < OCTREE_FORMAT_WIDE || header.format > OCTREE_FORMAT_SPLIT) {fprintf(stderr, "Unsupported octree file format %u\n", header.format); exit(1);}
+    format = (octree_format)header.format;
+  }
+  size = filesize - header_size();
+  assert(size % node_size(format) == 0);
   // It is unclear whether using MAP_PRIVATE or MAP_SHARED for mmap makes any difference.
-  root = (octree*)mmap(NULL, size, PROT_READ, MAP_PRIVATE | MAP_NORESERVE, fd, 0);
-  if (root == MAP_FAILED) {perror("Could not map octree file to memory for reading"); exit(1);} 
+  char * data = (char*)mmap(NULL, filesize, PROT_READ, MAP_PRIVATE | MAP_NORESERVE, fd, 0);
+  if (data == MAP_FAILED) {perror("Could not map octree file to memory for reading"); exit(1);} 
+  root = (octree*)(data + header_size());
 }
 
-octree_file::octree_file(const char* filename, uint32_t size) : write(true), size(size) {
+octree_file::octree_file(const char* filename, uint64_t size, octree_format format) : write(true), format(format), size(size) {
   fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
   if (fd == -1) {perror("Could not open/creat file"); exit(1);}
-  int ret = ftruncate(fd, size);
+  uint64_t filesize = header_size() + size;
+  int ret = ftruncate(fd, filesize);
   if (ret) {perror("Could not reserve diskspace"); exit(1);}
-  assert(size % sizeof(octree) == 0);
+  assert(size % node_size(format) == 0);
   // This requires MAP_SHARED for mmap as changes must be written to disk
-  root = (octree*)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-  if (root == MAP_FAILED) {perror("Could not map octree file to memory for writing"); exit(1);} 
+  char * data = (char*)mmap(NULL, filesize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (data == MAP_FAILED) {perror("Could not map octree file to memory for writing"); exit(1);} 
+  if (format != OCTREE_FORMAT_OC2) {
+    octree_header header = {{OCTREE_MAGIC[0], OCTREE_MAGIC[1], OCTREE_MAGIC[2], OCTREE_MAGIC[3]}, format, 0, 0};
+    std::copy((char*)&header, (char*)(&header + 1), data);
+  }
+  root = (octree*)(data + header_size());
 }
 
 octree_file::~octree_file() {
-  if (root!=MAP_FAILED)
-    munmap(root, size);
+  char * data = (char*)root - header_size();
+  if (data!=MAP_FAILED)
+    munmap(data, header_size() + size);
   if (fd!=-1)
     close(fd);
 }
@@ -0,0 +1,361 @@
+/*
+    Voxel-Engine - A CPU based sparse octree renderer.
+    Copyright (C) 2015  B.J. Conijn <bcmpinc@users.sourceforge.net>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <cstdio>
+#include <cstdlib>
+#include <cassert>
+#include <vector>
+#include <deque>
+
+#include "octree.h"
+
+/** Marks an index that has not been assigned a position in the output yet. */
+static const uint64_t UNPLACED = ~uint64_t(0);
+
+/** Relayouts the given octree, whose nodes have child entries of type child_t.
+ * @param n the number of nodes in the octree, including the node headers. */
+template<class child_t>
+static void relayout(const basic_octree<child_t> * root, child_t n, octree_format format, const char * filename) {
+  typedef basic_octree<child_t> octree_node;
+  const child_t page_nodes = OCTREE_PAGE_SIZE / sizeof(octree_node);
+  // The node array starts after the header, which is mapped to memory as well. Hence pages start this many nodes earlier.
+  const child_t header_nodes = octree_file::header_size(format) / sizeof(octree_node);
+  assert(n > 0);
+  // Maps positions in the input to positions in the output.
+  std::vector<child_t> index(n, child_t(UNPLACED));
+  // The positions in the input, in the order in which these are written to the output.
+  std::vector<child_t> order;
+  child_t next = 0;
+  // Roots of subtrees that have not been placed yet. The last one is laid out first.
+  std::vector<child_t> blocks(1, 0);
+  std::deque<child_t> queue;
+  std::vector<child_t> remaining;
+  while (!blocks.empty()) {
+    child_t block = blocks.back();
+    blocks.pop_back();
+    if (index[block] != child_t(UNPLACED)) continue;
+    // Fill up the page in which the block starts, or start at the next page if its root does not fit.
+    // The unused part of the page is left zero.
+    child_t end = ((next + header_nodes) / page_nodes + 1) * page_nodes - header_nodes;
+    if (end - next < 1 + root[block].size()) {
+      next = end;
+      end += page_nodes;
+    }
+    index[block] = next;
+    next += 1 + root[block].size();
+    order.push_back(block);
+    queue.push_back(block);
+    // Add the nodes below the root of the block breadth first, until the page is full.
+    while (!queue.empty()) {
+      const octree_node & node = root[queue.front()];
+      queue.pop_front();
+      for (uint32_t i = 0; i < node.size(); i++) {
+        if (!node.is_pointer(i)) continue;
+        child_t child = node.child[i];
+        assert(child < n);
+        if (index[child] != child_t(UNPLACED)) continue;
+        child_t length = 1 + root[child].size();
+        if (next + length <= end) {
+          index[child] = next;
+          next += length;
+          order.push_back(child);
+          queue.push_back(child);
+        } else {
+          remaining.push_back(child);
+        }
+      }
+    }
+    // The subtrees that did not fit become blocks of their own, which are laid out depth first.
+    blocks.insert(blocks.end(), remaining.rbegin(), remaining.rend());
+    remaining.clear();
+  }
+  
+  // Copy the nodes to their new positions, rewriting their child pointers.
+  octree_file out(filename, uint64_t(next) * sizeof(octree_node), format);
+  octree_node * out_root = out.nodes<octree_node>();
+  for (child_t old : order) {
+    const octree_node & node = root[old];
+    octree_node & copy = out_root[index[old]];
+    copy.avgcolor = node.avgcolor;
+    copy.bitmask = node.bitmask;
+    for (uint32_t i = 0; i < node.size(); i++) {
+      copy.child[i] = node.is_pointer(i) ? index[node.child[i]] : node.child[i];
+    }
+  }
+}
+
+void octree_relayout(const octree_file * in, const char * filename) {
+  if (in->format == OCTREE_FORMAT_COMPACT || in->format == OCTREE_FORMAT_SPLIT) {
+    fprintf(stderr, "Octree files in the compact or split format cannot be relayouted.\n"); 
+    exit(1);
+  } else if (in->format == OCTREE_FORMAT_WIDE) {
+    relayout(in->nodes<octree64>(), in->size / sizeof(octree64), in->format, filename);
+  } else {
+    relayout(in->nodes<octree>(), uint32_t(in->size / sizeof(octree)), in->format, filename);
+  }
+}
+
+/** Encodes an octree in the compact format, see octree_compact. 
+ * The nodes are placed in depth first order, such that a child is placed after its parent, 
+ * its preceding siblings and their descendants. The entries of children that are too far away, 
+ * or that were placed before their parent as they are shared, refer to far pointers placed directly after the parent. 
+ * The colors of leaves that have siblings which are nodes are placed after these far pointers. 
+ * As these far pointers move the children further away, the layout is determined in two passes: 
+ * measure computes the size of each subtree bottom up, after which place assigns the positions top down.
+ */
+template<class child_t>
+struct compact_encoder {
+  typedef basic_octree<child_t> octree_node;
+  const octree_node * root;
+  /** Size of the subtree of each node in units of 4 bytes, counting shared nodes only in the subtree where these are placed. 
+   * UNPLACED for nodes that have not been measured yet. */
+  std::vector<uint64_t> subtree;
+  /** For each node the bitmask of the positions in its child array that refer to a far pointer. */
+  std::vector<uint8_t> far;
+  /** Maps positions in the input to positions in the output. */
+  std::vector<uint64_t> index;
+  /** The positions in the input, in the order in which these are written to the output. */
+  std::vector<child_t> order;
+  uint64_t next;
+  
+  compact_encoder(const octree_node * root, child_t n) : root(root), subtree(n, UNPLACED), far(n, 0), index(n, UNPLACED), next(0) {}
+  
+  /** Returns the number of children of the given node that are leaves. */
+  static uint32_t leaf_count(const octree_node & node) {
+    uint32_t count = 0;
+    for (uint32_t k = 0; k < node.size(); k++) {
+      if (!node.is_pointer(k)) count++;
+    }
+    return count;
+  }
+  
+  /** Checks whether all children of the given node are leaves, in which case its child array consists of their colors. */
+  static bool leaves(const octree_node & node) {
+    return leaf_count(node) == node.size();
+  }
+  
+  /** Returns the size of the given node in units of 4 bytes. */
+  uint64_t node_size(child_t i) {
+    const octree_node & node = root[i];
+    if (leaves(node)) return 1 + node.size();
+    return 1 + (node.size() + 1) / 2 + 2 * popcount(far[i]) + leaf_count(node);
+  }
+  
+  /** Computes the size of the subtree of the given node and which of its children are referred to by far pointers. */
+  uint64_t measure(child_t i) {
+    const octree_node & node = root[i];
+    subtree[i] = 0; // Mark as measured, as it is placed at this point.
+    if (leaves(node)) return subtree[i] = node_size(i);
+    uint64_t size[8];
+    uint8_t shared = 0;
+    for (uint32_t k = 0; k < node.size(); k++) {
+      child_t child = node.child[k];
+      if (!node.is_pointer(k)) {
+        size[k] = 0;
+      } else if (subtree[child] != UNPLACED) {
+        shared |= 1<<k;
+        size[k] = 0;
+      } else {
+        size[k] = measure(child);
+      }
+    }
+    // Adding far pointers enlarges the node, which can push more children out of reach.
+    far[i] = shared;
+    for (;;) {
+      uint64_t offset = node_size(i);
+      uint8_t mask = shared;
+      for (uint32_t k = 0; k < node.size(); k++) {
+        if (node.is_pointer(k) && !(shared & (1<<k)) && offset > octree_compact::MAX_OFFSET) mask |= 1<<k;
+        offset += size[k];
+      }
+      if (mask == far[i]) return subtree[i] = offset;
+      far[i] = mask;
+    }
+  }
+  
+  /** Assigns positions to the nodes of the subtree of the given node, in the order in which measure visited them. */
+  void place(child_t i) {
+    const octree_node & node = root[i];
+    index[i] = next;
+    next += node_size(i);
+    order.push_back(i);
+    if (leaves(node)) return;
+    for (uint32_t k = 0; k < node.size(); k++) {
+      if (node.is_pointer(k) && index[node.child[k]] == UNPLACED) place(node.child[k]);
+    }
+  }
+  
+  /** Writes the given node to its position in the output. */
+  void write(octree_compact * out, child_t i) {
+    const octree_node & node = root[i];
+    uint64_t position = index[i];
+    octree_compact & copy = out[position];
+    copy.avgcolor = node.avgcolor;
+    copy.bitmask = node.bitmask;
+    uint32_t * words = reinterpret_cast<uint32_t *>(&copy);
+    if (leaves(node)) {
+      for (uint32_t k = 0; k < node.size(); k++) {
+        words[1 + k] = node.child[k];
+      }
+      return;
+    }
+    uint16_t * entries = reinterpret_cast<uint16_t *>(words + 1);
+    uint64_t far_pointer = 1 + (node.size() + 1) / 2;
+    uint64_t color = far_pointer + 2 * popcount(far[i]);
+    if (node.size() & 1) entries[node.size()] = 0; // Padding.
+    for (uint32_t k = 0; k < node.size(); k++) {
+      child_t child = node.child[k];
+      if (!node.is_pointer(k)) {
+        words[color] = child;
+        entries[k] = color << octree_compact::OFFSET_SHIFT | octree_compact::COLOR;
+        color++;
+        continue;
+      }
+      uint16_t flags = leaves(root[child]) ? octree_compact::LEAVES : 0;
+      uint64_t offset = index[child] - position;
+      if (far[i] & (1<<k)) {
+        words[far_pointer] = index[child];
+        words[far_pointer + 1] = index[child] >> 32;
+        offset = far_pointer;
+        flags |= octree_compact::FAR;
+        far_pointer += 2;
+      }
+      assert(0 < offset && offset <= octree_compact::MAX_OFFSET);
+      entries[k] = offset << octree_compact::OFFSET_SHIFT | flags;
+    }
+  }
+};
+
+/** Encodes the given octree, whose nodes have child entries of type child_t, in the compact format.
+ * @param n the number of nodes in the octree, including the node headers. */
+template<class child_t>
+static void compact_encode(const basic_octree<child_t> * root, child_t n, const char * filename) {
+  assert(n > 0);
+  compact_encoder<child_t> encoder(root, n);
+  encoder.measure(0);
+  encoder.place(0);
+  octree_file out(filename, encoder.next * sizeof(octree_compact), OCTREE_FORMAT_COMPACT);
+  out.header()->root = encoder.leaves(root[0]) ? octree_compact::LEAVES : 0;
+  for (child_t i : encoder.order) {
+    encoder.write(out.nodes<octree_compact>(), i);
+  }
+}
+
+void octree_compact_encode(const octree_file * in, const char * filename) {
+  if (in->format == OCTREE_FORMAT_COMPACT || in->format == OCTREE_FORMAT_SPLIT) {
+    fprintf(stderr, "Octree files in the compact or split format cannot be encoded in the compact format.\n"); 
+    exit(1);
+  } else if (in->format == OCTREE_FORMAT_WIDE) {
+    compact_encode(in->nodes<octree64>(), in->size / sizeof(octree64), filename);
+  } else {
+    compact_encode(in->nodes<octree>(), uint32_t(in->size / sizeof(octree)), filename);
+  }
+}
+
+/** Encodes an octree in the split format, see octree_split. 
+ * The nodes are placed in depth first order in the topology array, and their colors in the same order in the color array. */
+template<class child_t>
+struct split_encoder {
+  typedef basic_octree<child_t> octree_node;
+  const octree_node * root;
+  /** Maps positions in the input to positions in the topology array. */
+  std::vector<uint64_t> index;
+  /** The positions in the input, in the order in which these are written to the output. */
+  std::vector<child_t> order;
+  uint64_t topology_size;
+  uint64_t color_size;
+  
+  split_encoder(const octree_node * root, child_t n) : root(root), index(n, UNPLACED), topology_size(0), color_size(0) {}
+  
+  /** Returns the number of children of the given node that are leaves. */
+  static uint32_t leaf_count(const octree_node & node) {
+    uint32_t count = 0;
+    for (uint32_t k = 0; k < node.size(); k++) {
+      if (!node.is_pointer(k)) count++;
+    }
+    return count;
+  }
+  
+  /** Assigns positions in the topology array to the nodes of the subtree of the given node. */
+  void place(child_t i) {
+    const octree_node & node = root[i];
+    uint32_t leaves = leaf_count(node);
+    index[i] = topology_size;
+    topology_size += 2 + node.size() - leaves;
+    color_size += 1 + leaves;
+    order.push_back(i);
+    for (uint32_t k = 0; k < node.size(); k++) {
+      if (node.is_pointer(k) && index[node.child[k]] == UNPLACED) place(node.child[k]);
+    }
+  }
+  
+  /** Writes the nodes to the given topology and color arrays. */
+  void write(uint32_t * topology, uint32_t * colors) {
+    uint32_t color = 0;
+    for (child_t i : order) {
+      const octree_node & node = root[i];
+      octree_split & copy = *reinterpret_cast<octree_split *>(topology + index[i]);
+      copy.bitmask = node.bitmask;
+      copy.leaves = 0;
+      copy.color = color;
+      colors[color++] = node.avgcolor;
+      uint32_t pos = 0;
+      for (int k = 0; k < 8; k++) {
+        if (!node.has_index(k)) continue;
+        child_t child = node.child[node.position(k)];
+        if (node.is_pointer(node.position(k))) {
+          copy.child[pos++] = index[child];
+        } else {
+          copy.leaves |= 1<<k;
+          colors[color++] = child;
+        }
+      }
+    }
+  }
+};
+
+/** Encodes the given octree, whose nodes have child entries of type child_t, in the split format.
+ * @param n the number of nodes in the octree, including the node headers. */
+template<class child_t>
+static void split_encode(const basic_octree<child_t> * root, child_t n, const char * filename) {
+  assert(n > 0);
+  split_encoder<child_t> encoder(root, n);
+  encoder.place(0);
+  if (encoder.topology_size + encoder.color_size > UINT32_MAX) {
+    fprintf(stderr, "The octree is too large for the split format.\n"); 
+    exit(1);
+  }
+  octree_file out(filename, (encoder.topology_size + encoder.color_size) * sizeof(uint32_t), OCTREE_FORMAT_SPLIT);
+  out.header()->colors = encoder.topology_size;
+  uint32_t * topology = out.nodes<uint32_t>();
+  encoder.write(topology, topology + encoder.topology_size);
+}
+
+void octree_split_encode(const octree_file * in, const char * filename) {
+  if (in->format == OCTREE_FORMAT_COMPACT || in->format == OCTREE_FORMAT_SPLIT) {
+    fprintf(stderr, "Octree files in the compact or split format cannot be encoded in the split format.\n"); 
+    exit(1);
+  } else if (in->format == OCTREE_FORMAT_WIDE) {
+    split_encode(in->nodes<octree64>(), in->size / sizeof(octree64), filename);
+  } else {
+    split_encode(in->nodes<octree>(), uint32_t(in->size / sizeof(octree)), filename);
+  }
+}
+
+// kate: space-indent on; indent-width 2; mixedindent off; indent-mode cstyle; 
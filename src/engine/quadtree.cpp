@@ -18,34 +18,69 @@
 
 #include <cassert>
 #include <cstring>
+#include <algorithm>
+#include <immintrin.h>
 #include "quadtree.h"
 
 static const uint32_t B[] = {0x00FF00FF, 0x0F0F0F0F, 0x33333333, 0x55555555};
 static const uint32_t S[] = {8, 4, 2, 1};
 
+/** Returns whether pdep and pext are available and fast, which excludes the AMD cpus that implement them in microcode. */
+static bool fast_bmi2() {
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("bmi2") && !__builtin_cpu_is("bdver4") && !__builtin_cpu_is("znver1") && !__builtin_cpu_is("znver2");
+}
+static const bool use_bmi2 = fast_bmi2();
+
+__attribute__((target("bmi2")))
+static uint32_t interleave_bmi2(uint32_t x, uint32_t y) {
+    return _pdep_u32(x, 0x55555555) | _pdep_u32(y, 0xaaaaaaaa);
+}
+
+__attribute__((target("bmi2")))
+static void deinterleave_bmi2(uint32_t v, uint32_t & x, uint32_t & y) {
+    x = _pext_u32(v, 0x55555555);
+    y = _pext_u32(v, 0xaaaaaaaa);
+}
+
 void quadtree::set(uint32_t x, uint32_t y) {
-    for (int i=0; i<4; i++) {
-        x = (x | (x << S[i])) & B[i];
-        y = (y | (y << S[i])) & B[i];
+    uint32_t v;
+    if (use_bmi2) {
+        v = N + interleave_bmi2(x, y);
+    } else {
+        for (int i=0; i<4; i++) {
+            x = (x | (x << S[i])) & B[i];
+            y = (y | (y << S[i])) & B[i];
+        }
+        v = N + (x | (y<<1));
     }
-    uint32_t v = N + (x | (y<<1));
     children[v/4] &= ~(16<<(v&3));
 }
 
 void quadtree::draw(uint32_t v, uint32_t color, uint32_t depth) {
+    if (morton_data) {
+        morton_data[v-N] = color;
+        morton_depth[v-N] = depth;
+        return;
+    }
     // Uses 5-10 ms per frame.
     // children[v/4] &= ~(16<<(v&3)); // Moved to octree_draw.
     v -= N;
-    uint32_t x = v;
-    uint32_t y = v>>1;
-    for (int i=3; i>=0; i--) {
-        x &= B[i];
-        y &= B[i];
-        x = (x | (x >> S[i]));
-        y = (y | (y >> S[i]));
+    uint32_t x, y;
+    if (use_bmi2) {
+        deinterleave_bmi2(v, x, y);
+    } else {
+        x = v;
+        y = v>>1;
+        for (int i=3; i>=0; i--) {
+            x &= B[i];
+            y &= B[i];
+            x = (x | (x >> S[i]));
+            y = (y | (y >> S[i]));
+        }
+        x &= 0xffff;
+        y &= 0xffff;
     }
-    x &= 0xffff;
-    y &= 0xffff;
 
     assert(x<surf.width && y<surf.height);
     int64_t i = x+y*surf.width;
@@ -55,17 +90,115 @@ void quadtree::draw(uint32_t v, uint32_t color, uint32_t depth) {
     }
 }
 
-quadtree::quadtree() {}
-quadtree::quadtree(surface surf) : surf(surf) {
-    memset(children, 0, sizeof(children));
+quadtree::quadtree() : 
+    dim(0), children(nullptr), morton_data(nullptr), morton_depth(nullptr), 
+    scissor_x0(0), scissor_y0(0), scissor_x1(UINT32_MAX), scissor_y1(UINT32_MAX)
+{
+    resize(1, 1);
+}
+
+quadtree::quadtree(surface surf) : 
+    dim(0), surf(surf), children(nullptr), morton_data(nullptr), morton_depth(nullptr), 
+    scissor_x0(0), scissor_y0(0), scissor_x1(UINT32_MAX), scissor_y1(UINT32_MAX)
+{
+    resize(surf.width, surf.height);
+    memset(children - 1, 0, N + 1);
+}
+
+quadtree::~quadtree() {
+    set_deferred(false);
+    delete[] (children - 1);
+}
+
+void quadtree::resize(uint32_t width, uint32_t height) {
+    uint32_t new_dim = MIN_DIM;
+    while ((1u<<new_dim) < width || (1u<<new_dim) < height) new_dim++;
+    assert(new_dim <= MAX_DIM);
+    if (new_dim == dim) return;
+    bool deferred = morton_data;
+    set_deferred(false);
+    if (children) delete[] (children - 1);
+    dim = new_dim;
+    SIZE = 1<<dim;
+    N = (1<<dim<<dim)/3-1;
+    M = N/4-1;
+    children = new uint8_t[N + 1] + 1;
+    set_deferred(deferred);
+}
+
+void quadtree::set_deferred(bool enabled) {
+    if (enabled == (morton_data != nullptr)) return;
+    if (enabled) {
+        morton_data = new uint32_t[SIZE*SIZE];
+        morton_depth = new uint32_t[SIZE*SIZE];
+    } else {
+        delete[] morton_data;
+        delete[] morton_depth;
+        morton_data = morton_depth = nullptr;
+    }
+}
+
+/** Copies the pixels of a 2x2 block for which the bits 4-7 of drawn are set. 
+ * Pixels 0 and 1 of the block go to row0, and pixels 2 and 3 to row1. */
+static inline void resolve_block(const uint32_t * block, uint32_t * row0, uint32_t * row1, uint32_t drawn) {
+    if (drawn == 0xf0) {
+        __m128i v = _mm_loadu_si128((const __m128i*)block);
+        _mm_storel_epi64((__m128i*)row0, v);
+        _mm_storel_epi64((__m128i*)row1, _mm_unpackhi_epi64(v, v));
+    } else {
+        if (drawn & 0x10) row0[0] = block[0];
+        if (drawn & 0x20) row0[1] = block[1];
+        if (drawn & 0x40) row1[0] = block[2];
+        if (drawn & 0x80) row1[1] = block[3];
+    }
+}
+
+void quadtree::resolve(uint32_t y0, uint32_t y1) {
+    assert(y0 % 2 == 0);
+    // Only the blocks that overlap the scissor rectangle can contain drawn pixels.
+    uint32_t left   = std::min(scissor_x0, surf.width);
+    uint32_t right  = std::min(scissor_x1, surf.width);
+    uint32_t top    = std::min(scissor_y0, surf.height);
+    uint32_t bottom = std::min(scissor_y1, surf.height);
+    y0 = std::max(y0, top & ~1);
+    y1 = std::min(y1, bottom);
+    // Interleave the bits of the first block column with zeros.
+    uint32_t mx0 = left>>1;
+    for (int i=0; i<4; i++) {
+        mx0 = (mx0 | (mx0 << S[i])) & B[i];
+    }
+    for (uint32_t y = y0; y < y1; y += 2) {
+        // Interleave the bits of the block row with zeros.
+        uint32_t my = y>>1;
+        for (int i=0; i<4; i++) {
+            my = (my | (my << S[i])) & B[i];
+        }
+        my <<= 1;
+        uint32_t * row0 = surf.data + int64_t(y)*surf.width;
+        uint32_t * row1 = row0 + surf.width;
+        uint32_t * depth0 = surf.depth ? surf.depth + int64_t(y)*surf.width : nullptr;
+        uint32_t * depth1 = surf.depth ? depth0 + surf.width : nullptr;
+        // Pixels outside of the scissor rectangle have no bits set in the quadtree, hence these must be excluded explicitly.
+        uint32_t rows = (y >= top ? 0x30 : 0) | (y+1 < bottom ? 0xc0 : 0);
+        uint32_t mx = mx0;
+        for (uint32_t x = left & ~1; x < right; x += 2) {
+            // The children of leaf-parent M+m are the pixels at 4*m up to 4*m+3 of the Morton ordered buffers.
+            uint32_t m = mx | my;
+            uint32_t columns = (x >= left ? 0x50 : 0) | (x+1 < right ? 0xa0 : 0);
+            uint32_t drawn = ~children[M+m] & rows & columns;
+            if (drawn) {
+                resolve_block(morton_data + 4*m, row0 + x, row1 + x, drawn);
+                if (depth0) resolve_block(morton_depth + 4*m, depth0 + x, depth1 + x, drawn);
+            }
+            mx = ((mx | 0xaaaaaaaa) + 1) & 0x55555555; // Increment the interleaved x coordinate.
+        }
+    }
 }
 
 void quadtree::build_fill(int i) {
     int n=1;
     while (i<N) {
-        for (int j=0; j<n; j++) {
-            children[i+j]=0xf0;
-        }
+        memset(children + i, 0xf0, n);
         i++;
         i<<=2;
         n<<=2;
@@ -73,21 +206,21 @@ void quadtree::build_fill(int i) {
     
 }
 
-bool quadtree::build_check(int w, int h, int i, int size) {
+bool quadtree::build_check(int x0, int y0, int x1, int y1, int i, int size) {
     if (i < N) {
         children[i]=0;
     }
     // Check if entirely outside of frustum.
-    if (w<=0 || h<=0) {
+    if (x1<=0 || y1<=0 || x0>=size || y0>=size) {
         return false;
     }
     // Check if partially out of frustum.
-    if (i<N && (w<size || h<size)) {
+    if (i<N && (x0>0 || y0>0 || x1<size || y1<size)) {
         size/=2;
-        children[i] |= build_check(w,     h,     i*4+4,size) << 4;
-        children[i] |= build_check(w-size,h,     i*4+5,size) << 5;
-        children[i] |= build_check(w,     h-size,i*4+6,size) << 6;
-        children[i] |= build_check(w-size,h-size,i*4+7,size) << 7;
+        children[i] |= build_check(x0,     y0,     x1,     y1,     i*4+4,size) << 4;
+        children[i] |= build_check(x0-size,y0,     x1-size,y1,     i*4+5,size) << 5;
+        children[i] |= build_check(x0,     y0-size,x1,     y1-size,i*4+6,size) << 6;
+        children[i] |= build_check(x0-size,y0-size,x1-size,y1-size,i*4+7,size) << 7;
         return children[i];
     }
     build_fill(i);
@@ -95,12 +228,22 @@ bool quadtree::build_check(int w, int h, int i, int size) {
 }
 
 void quadtree::build() {
-    build_check(surf.width, surf.height, -1, SIZE);
+    build_check(
+        std::min(scissor_x0, surf.width), std::min(scissor_y0, surf.height), 
+        std::min(scissor_x1, surf.width), std::min(scissor_y1, surf.height), 
+        -1, SIZE
+    );
+}
+
+void quadtree::set_scissor(uint32_t x0, uint32_t y0, uint32_t x1, uint32_t y1) {
+    assert(x0 <= x1 && y0 <= y1);
+    scissor_x0 = x0;
+    scissor_y0 = y0;
+    scissor_x1 = x1;
+    scissor_y1 = y1;
 }
 
-const unsigned int quadtree::dim;
-const unsigned int quadtree::SIZE;
-const int quadtree::N;
-const int quadtree::M;
+const uint32_t quadtree::MIN_DIM;
+const uint32_t quadtree::MAX_DIM;
 
     
\ No newline at end of file
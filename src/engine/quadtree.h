@@ -23,24 +23,34 @@
 
 struct quadtree {
 public:
+    /** The range of the number of levels in the quadtree. 
+     * The maximum allows rendering at 4096x4096, while the minimum ensures that the levels used for parallel rendering exist. */
+    static const uint32_t MIN_DIM = 5;
+    static const uint32_t MAX_DIM = 12;
+    
     /** The number of levels in the quadtree.
-     * This should be the lowest number such that width and height are at most (1<<dim). 
+     * This is the lowest number such that width and height are at most (1<<dim), see resize. 
      */
-    static const uint32_t dim = 10;
-    static const uint32_t SIZE = 1<<dim;
-    static const int N = (1<<dim<<dim)/3-1;
-    static const int M = N/4-1;
+    uint32_t dim;
+    uint32_t SIZE; //< 1<<dim
+    int N;         //< The index of the first leaf node, (1<<dim<<dim)/3-1.
+    int M;         //< The index of the first node whose children are leaves, N/4-1.
     
     surface surf;
 
-    /** children[-1] */
-    uint32_t rootnode;
-    
     /** 
      * The quadtree is stored in a heap-like fashion as a single array.
      * The child nodes of map[i] are map[4*i+4], ..., map[4*i+7].
+     * It has N elements, and children[-1] is the root node.
+     * Only bits 4-7 are used, bit 4+i being set if child i still has to be rendered. 
+     * Hence a single byte per node suffices, which keeps the upper levels within a few cache lines.
      */
-    uint32_t children[N];
+    uint8_t * children;
+
+    /** Color and depth buffers in Morton order, indexed by leafnode-N, or null if pixels are drawn to surf directly. 
+     * When used, resolve must be called to copy the drawn pixels to surf. */
+    uint32_t * morton_data;
+    uint32_t * morton_depth;
 
     /** Creates a new quadtree, to be used for rendering to the width * height * 32bit image buffer in pixels. 
      * It is assumed that the second row of pixels starts at pixels[width]. */
@@ -50,16 +60,40 @@ public:
     /** Draws the pixel associated with the given leafnode. */
     void draw(uint32_t v, uint32_t color, uint32_t depth);
     
-    /** Initializes the quadtree such that all quadtree nodes within view are set to 1. */    
+    /** Changes dim to the lowest number such that width and height are at most (1<<dim), 
+     * and allocates the nodes (and buffers) for that number of levels. Does nothing if dim does not change. */
+    void resize(uint32_t width, uint32_t height);
+    
+    /** Initializes the quadtree such that all quadtree nodes within view are set to 1. 
+     * Only the nodes within the scissor rectangle are written, mostly by filling whole levels of a subtree at once. 
+     * This is called every frame, as it is faster than restoring a copy that was built once per resolution. */
     void build();
     
+    /** Restricts rendering to the pixels in columns x0 up to x1 and rows y0 up to y1. 
+     * The rectangle is clipped to the surface, hence by default the entire surface is rendered. */
+    void set_scissor(uint32_t x0, uint32_t y0, uint32_t x1, uint32_t y1);
+    
+    /** Enables or disables drawing to the Morton ordered buffers. */
+    void set_deferred(bool enabled);
+    
+    /** Copies the pixels drawn to the Morton ordered buffers in rows y0 up to y1 to surf. 
+     * The pixels that were not drawn, or are outside the scissor rectangle, are left untouched. This requires y0 to be even. */
+    void resolve(uint32_t y0, uint32_t y1);
+    
+    ~quadtree();
+    
 private:
+    quadtree(const quadtree&);
+    quadtree& operator=(const quadtree&);
+    
     /** Sets a single value at given coordinates on the bottom level of the tree. (unused) 
      * Does not propagate this value through the rest of the tree. */
     void set(uint32_t x, uint32_t y);
     
+    uint32_t scissor_x0, scissor_y0, scissor_x1, scissor_y1; //< The scissor rectangle, see set_scissor.
+    
     void build_fill(int i);
-    bool build_check(int w, int h, int i, int size);
+    bool build_check(int x0, int y0, int x1, int y1, int i, int size);
 };
 
 
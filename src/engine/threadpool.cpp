@@ -0,0 +1,103 @@
+/*
+    Voxel-Engine - A CPU based sparse octree renderer.
+    Copyright (C) 2015  B.J. Conijn <bcmpinc@users.sourceforge.net>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <cassert>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "threadpool.h"
+
+struct threadpool_data {
+    std::vector<std::thread> workers;
+    std::mutex lock;
+    std::condition_variable start, finish;
+    const std::function<void(int)> * task;
+    std::atomic<int> next;
+    int n;
+    int busy;         //< Number of workers still working on the current batch.
+    unsigned batch;   //< Incremented for each call to run().
+    bool quit;
+    
+    /** Executes tasks of the current batch until none are left. */
+    void work() {
+        for (int i = next++; i < n; i = next++) {
+            (*task)(i);
+        }
+    }
+    
+    void worker() {
+        unsigned seen = 0;
+        std::unique_lock<std::mutex> l(lock);
+        while (true) {
+            start.wait(l, [&]{return quit || batch != seen;});
+            if (quit) return;
+            seen = batch;
+            l.unlock();
+            work();
+            l.lock();
+            if (--busy == 0) finish.notify_one();
+        }
+    }
+};
+
+threadpool::threadpool(int threads) : data(new threadpool_data()) {
+    assert(threads >= 1);
+    data->task = nullptr;
+    data->next = 0;
+    data->n = 0;
+    data->busy = 0;
+    data->batch = 0;
+    data->quit = false;
+    for (int i = 1; i < threads; i++) {
+        data->workers.emplace_back(&threadpool_data::worker, data);
+    }
+}
+
+threadpool::~threadpool() {
+    {
+        std::lock_guard<std::mutex> l(data->lock);
+        data->quit = true;
+    }
+    data->start.notify_all();
+    for (std::thread & t : data->workers) {
+        t.join();
+    }
+    delete data;
+}
+
+void threadpool::run(int n, const std::function<void(int)> & task) {
+    {
+        std::lock_guard<std::mutex> l(data->lock);
+        data->task = &task;
+        data->n = n;
+        data->next = 0;
+        data->busy = data->workers.size();
+        data->batch++;
+    }
+    data->start.notify_all();
+    data->work();
+    std::unique_lock<std::mutex> l(data->lock);
+    data->finish.wait(l, [&]{return data->busy == 0;});
+}
+
+int threadpool::size() const {
+    return data->workers.size() + 1;
+}
@@ -0,0 +1,42 @@
+/*
+    Voxel-Engine - A CPU based sparse octree renderer.
+    Copyright (C) 2015  B.J. Conijn <bcmpinc@users.sourceforge.net>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+#include <functional>
+
+struct threadpool_data;
+/** A fixed set of worker threads that execute batches of independent tasks. */
+struct threadpool {
+    /** Starts threads-1 worker threads. The thread calling run() acts as the remaining worker. */
+    threadpool(int threads);
+    ~threadpool();
+    
+    /** Calls task(i) for each i in [0, n) and returns when all calls have finished.
+     * Tasks are handed out one at a time, so they may differ in duration. */
+    void run(int n, const std::function<void(int)> & task);
+    
+    /** Returns the number of threads, including the calling thread. */
+    int size() const;
+private:
+    threadpool(const threadpool&);
+    threadpool& operator=(const threadpool&);
+    threadpool_data * data;
+};
+
+#endif // THREADPOOL_H
@@ -27,7 +27,7 @@
 #include <winbase.h>
 
 struct TimerData {
-    LARGE_INTEGER begin, end, freq;
+    LARGE_INTEGER begin, freq;
 };
 
 Timer::Timer() : data(new TimerData())
@@ -41,8 +41,9 @@ Timer::Timer() : data(new TimerData())
 
 double Timer::elapsed()
 {
-	QueryPerformanceCounter(&data->end);
-	return (data->end.QuadPart - data->begin.QuadPart)*1000./(double)data->freq.QuadPart;
+	LARGE_INTEGER end;
+	QueryPerformanceCounter(&end);
+	return (end.QuadPart - data->begin.QuadPart)*1000./(double)data->freq.QuadPart;
 }
 
 #else
@@ -67,7 +68,7 @@ double Timing::elapsed()
 #include <time.h>
 
 struct TimerData {
-    timespec begin, end, freq;
+    timespec begin, freq;
 };
 
 Timer::Timer() : data(new TimerData())
@@ -79,8 +80,9 @@ Timer::Timer() : data(new TimerData())
 
 double Timer::elapsed()
 {
-	clock_gettime(CLOCK_MONOTONIC, &data->end);
-	return (data->end.tv_sec-data->begin.tv_sec)*1000.0 + (data->end.tv_nsec-data->begin.tv_nsec)/1000000.0;
+	timespec end;
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	return (end.tv_sec-data->begin.tv_sec)*1000.0 + (end.tv_nsec-data->begin.tv_nsec)/1000000.0;
 }
 #else
 // Low resolution linux timer
@@ -25,7 +25,8 @@ struct Timer {
     Timer();
     ~Timer();
     
-    /** Return time elapsed since last reset in millseconds. */
+    /** Return time elapsed since last reset in millseconds. 
+     * This can be called from multiple threads at the same time. */
     double elapsed();
 private:
     Timer(const Timer&);
@@ -0,0 +1,54 @@
+/*
+    Voxel-Engine - A CPU based sparse octree renderer.
+    Copyright (C) 2015  B.J. Conijn <bcmpinc@users.sourceforge.net>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include "timing.h"
+#include "octree.h"
+
+int main(int argc, char ** argv) {
+  bool compact = argc == 4 && strcmp(argv[1], "-compact") == 0;
+  bool split = argc == 4 && strcmp(argv[1], "-split") == 0;
+  if (argc != 3 && !compact && !split) {
+    fprintf(stderr,"Usage: %s [-compact|-split] input_file output_file\n", argv[0]);
+    fprintf(stderr,"Rewrites an octree (*.oc2 or wide format) such that its subtrees are clustered in pages of memory.\n");
+    fprintf(stderr,"If -compact is given, it is rewritten in the compact format instead, which uses 16 bit child offsets.\n");
+    fprintf(stderr,"If -split is given, it is rewritten in the split format instead, which stores the colors separately.\n");
+    exit(2);
+  }
+  const char * infile = argv[argc-2];
+  const char * outfile = argv[argc-1];
+  Timer t;
+  octree_file in(infile);
+  if (compact) {
+    printf("[%10.0f] Encoding %s (%lu bytes) in the compact format into %s.\n", t.elapsed(), infile, in.size, outfile);
+    octree_compact_encode(&in, outfile);
+  } else if (split) {
+    printf("[%10.0f] Encoding %s (%lu bytes) in the split format into %s.\n", t.elapsed(), infile, in.size, outfile);
+    octree_split_encode(&in, outfile);
+  } else {
+    printf("[%10.0f] Clustering the nodes of %s (%lu bytes) into %s.\n", t.elapsed(), infile, in.size, outfile);
+    octree_relayout(&in, outfile);
+  }
+  printf("[%10.0f] Done.\n", t.elapsed());
+}
+
+// kate: space-indent on; indent-width 2; mixedindent off; indent-mode cstyle; 
@@ -40,11 +40,26 @@ using namespace std;
 ///////////////////////////////////////////////////////////////////////////////
 int main(int argc, char *argv[]) {
     bool capture = false;
+    int threads = 1;
+    int lod = 0;
+    double budget = 0;
+    bool deferred = false;
     const char * filename = nullptr;
     for (int i=1; i<argc; i++) { 
         if (argv[i][0]=='-') {
             if (strcmp(argv[i], "-capture") == 0) {
                 capture = true;
+            } else if (strcmp(argv[i], "-threads") == 0 && i+1<argc) {
+                threads = atoi(argv[++i]);
+                if (threads < 1) goto usage;
+            } else if (strcmp(argv[i], "-lod") == 0 && i+1<argc) {
+                lod = atoi(argv[++i]);
+                if (lod < 0) goto usage;
+            } else if (strcmp(argv[i], "-budget") == 0 && i+1<argc) {
+                budget = atof(argv[++i]);
+                if (budget < 0) goto usage;
+            } else if (strcmp(argv[i], "-deferred") == 0) {
+                deferred = true;
             } else {
                 fprintf(stderr,"unrecognized option: %s\n", argv[i]);
             }
@@ -55,12 +70,17 @@ int main(int argc, char *argv[]) {
     }
     if (filename == nullptr) {
         usage:
-        fprintf(stderr,"Usage: %s [-capture] octree_file\n", argv[0]);
+        fprintf(stderr,"Usage: %s [-capture] [-threads n] [-lod pixels] [-budget ms] [-deferred] octree_file\n", argv[0]);
         exit(2);
     }
 
     // Determine the file names.
     octree_file in(filename);
+    octree_set_threads(threads);
+    octree_set_lod(lod);
+    octree_set_budget(budget);
+    octree_set_deferred(deferred);
+    octree_set_background(true, 0xaaccffu);
 
     init_screen("Voxel renderer");
     position = glm::dvec3(0, 0, 0);
@@ -87,7 +107,6 @@ int main(int argc, char *argv[]) {
     while (!quit) {
         Timer t;
         if (moves) {
-            surf.clear(0xaaccffu);
             octree_draw(&in, surf, get_view_pane(),position, orientation);
             // Timer tt;
 #ifdef APPLY_SSAO
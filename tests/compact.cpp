@@ -0,0 +1,99 @@
+/*
+    Voxel-Engine - A CPU based sparse octree renderer.
+    Copyright (C) 2015  B.J. Conijn <bcmpinc@users.sourceforge.net>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+#include <glm/glm.hpp>
+
+#include "octree.h"
+#include "surface.h"
+
+/** Checks that an octree encoded in the compact format renders exactly like the original. 
+ * The octree contains nodes that have both leaves and nodes as children, and is large enough to require far pointers. */
+
+static uint32_t seed = 1;
+/** Returns a pseudo random number. */
+static uint32_t next_random() {
+  seed = seed * 1103515245 + 12345;
+  return seed >> 16;
+}
+
+/** Appends a random subtree of the given depth to the node array and returns the position of its root. 
+ * Some children above the lowest layer are leaves as well. */
+static uint32_t generate(std::vector<uint32_t> & nodes, int depth) {
+  uint32_t bitmask = next_random() & 0xff;
+  if (bitmask == 0) bitmask = 1;
+  uint32_t pos = nodes.size();
+  nodes.resize(pos + 1 + popcount(bitmask));
+  std::vector<uint32_t> child;
+  for (int i = 0; i < popcount(bitmask); i++) {
+    bool leaf = depth == 0 || next_random() % 3 == 0;
+    uint32_t color = (next_random() << 8 ^ next_random()) & 0xffffff;
+    child.push_back(leaf ? octree::COLOR | color : generate(nodes, depth - 1));
+  }
+  octree & node = *reinterpret_cast<octree *>(&nodes[pos]);
+  node.avgcolor = next_random();
+  node.bitmask = bitmask;
+  std::copy(child.begin(), child.end(), node.child);
+  return pos;
+}
+
+static void render(octree_renderer & renderer, octree_file * file, surface & s, glm::dvec3 position, glm::dmat3 orientation) {
+  view_pane view;
+  view.right = (double)s.width / s.height / 2;
+  view.left = -view.right;
+  view.top = 0.5;
+  view.bottom = -0.5;
+  s.clear(0xaaccff);
+  renderer.draw(file, s, view, position * (double)(1<<26), orientation);
+}
+
+int main() {
+  std::vector<uint32_t> nodes;
+  generate(nodes, 8);
+  {
+    octree_file in("test_compact_in.oc2", nodes.size() * sizeof(uint32_t));
+    std::copy(nodes.begin(), nodes.end(), in.nodes<uint32_t>());
+  }
+  octree_file in("test_compact_in.oc2");
+  octree_compact_encode(&in, "test_compact_out.oc2");
+  octree_file out("test_compact_out.oc2");
+  
+  const glm::dvec3 positions[] = {glm::dvec3(0,0,-2.5), glm::dvec3(0.2,0.1,-1.5), glm::dvec3(0.3,-0.2,0.1)};
+  const glm::dmat3 orientation(0.990, 0.101, 0.099, -0.050, 0.906, -0.421, -0.132, 0.412, 0.902);
+  octree_renderer renderer;
+  int failures = 0;
+  for (auto & position : positions) {
+    surface expected(160, 120, true);
+    render(renderer, &in, expected, position, orientation);
+    surface actual(160, 120, true);
+    render(renderer, &out, actual, position, orientation);
+    uint64_t pixels = expected.width * expected.height;
+    if (memcmp(expected.data, actual.data, pixels * 4) || memcmp(expected.depth, actual.depth, pixels * 4)) {
+      fprintf(stderr, "The compact octree renders differently at (%g, %g, %g).\n", position.x, position.y, position.z);
+      failures++;
+    }
+  }
+  remove("test_compact_in.oc2");
+  remove("test_compact_out.oc2");
+  return failures ? 1 : 0;
+}
+
+// kate: space-indent on; indent-width 2; mixedindent off; indent-mode cstyle; 
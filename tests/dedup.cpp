@@ -0,0 +1,88 @@
+/*
+    Voxel-Engine - A CPU based sparse octree renderer.
+    Copyright (C) 2015  B.J. Conijn <bcmpinc@users.sourceforge.net>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+#include <algorithm>
+
+#include "octree.h"
+
+/** Checks that octree_deduplicate merges identical subtrees and preserves the octree. 
+ * Cyclic octrees are covered by running the dedup tool on vxl/sponge.oc2. */
+
+/** Appends a node to the node array and returns its position. */
+static uint32_t add_node(std::vector<uint32_t> & nodes, uint32_t color, std::vector<uint32_t> child) {
+  uint32_t pos = nodes.size();
+  nodes.resize(pos + 1 + child.size());
+  octree & node = *reinterpret_cast<octree *>(&nodes[pos]);
+  node.avgcolor = color;
+  node.bitmask = (1 << child.size()) - 1;
+  std::copy(child.begin(), child.end(), node.child);
+  return pos;
+}
+
+/** Checks whether the subtrees at the given positions of both octrees are identical. */
+static bool same_subtree(const octree * a, uint32_t i, const octree * b, uint32_t j) {
+  if (a[i].avgcolor != b[j].avgcolor || a[i].bitmask != b[j].bitmask) return false;
+  for (uint32_t k = 0; k < a[i].size(); k++) {
+    if (a[i].is_pointer(k) != b[j].is_pointer(k)) return false;
+    if (a[i].is_pointer(k) ? !same_subtree(a, a[i].child[k], b, b[j].child[k]) : a[i].child[k] != b[j].child[k]) return false;
+  }
+  return true;
+}
+
+int main() {
+  const uint32_t C = octree::COLOR;
+  // Both children of the root are copies of the same subtree, which itself contains two distinct leaf nodes.
+  std::vector<uint32_t> nodes;
+  add_node(nodes, 0x808080, {0, 0});
+  uint32_t a1 = add_node(nodes, 0xff0000, {C|0xff0000, C|0xff0000});
+  uint32_t b1 = add_node(nodes, 0x00ff00, {C|0x00ff00, C|0x0000ff, C|0x00ff00});
+  uint32_t n1 = add_node(nodes, 0x808080, {a1, b1});
+  uint32_t a2 = add_node(nodes, 0xff0000, {C|0xff0000, C|0xff0000});
+  uint32_t b2 = add_node(nodes, 0x00ff00, {C|0x00ff00, C|0x0000ff, C|0x00ff00});
+  uint32_t n2 = add_node(nodes, 0x808080, {a2, b2});
+  nodes[1] = n1;
+  nodes[2] = n2;
+  
+  {
+    octree_file in("test_dedup_in.oc2", nodes.size() * sizeof(uint32_t));
+    std::copy(nodes.begin(), nodes.end(), reinterpret_cast<uint32_t *>(in.root));
+  }
+  octree_file in("test_dedup_in.oc2");
+  uint64_t size = octree_deduplicate(&in, "test_dedup_out.oc2");
+  octree_file out("test_dedup_out.oc2");
+  
+  int failures = 0;
+  // The root and the first copy of the shared subtree remain, which are the nodes before the second copy.
+  uint64_t expected = a2 * sizeof(uint32_t);
+  if (size != expected || out.size != expected) {
+    fprintf(stderr, "Deduplicated size is %lu bytes, expected %lu bytes.\n", out.size, expected);
+    failures++;
+  }
+  if (!same_subtree(in.nodes<octree>(), 0, out.nodes<octree>(), 0)) {
+    fprintf(stderr, "Deduplicated octree differs from its input.\n");
+    failures++;
+  }
+  remove("test_dedup_in.oc2");
+  remove("test_dedup_out.oc2");
+  return failures ? 1 : 0;
+}
+
+// kate: space-indent on; indent-width 2; mixedindent off; indent-mode cstyle; 
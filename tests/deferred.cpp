@@ -0,0 +1,70 @@
+/*
+    Voxel-Engine - A CPU based sparse octree renderer.
+    Copyright (C) 2013,2014  B.J. Conijn <bcmpinc@users.sourceforge.net>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <cstdio>
+#include <cstring>
+#include <glm/glm.hpp>
+
+#include "octree.h"
+#include "surface.h"
+
+/** Checks that rendering through the Morton ordered buffers, resolved by multiple threads,
+ * yields the same pixels as rendering directly, including for surfaces with an odd size. */
+
+static void render(octree_file * file, surface & s, glm::dvec3 position) {
+    view_pane view;
+    view.right = (double)s.width / s.height / 2;
+    view.left = -view.right;
+    view.top = 0.5;
+    view.bottom = -0.5;
+    s.clear(0xaaccff);
+    octree_draw(file, s, view, position * (double)(1<<26), glm::dmat3());
+}
+
+int main(int argc, char ** argv) {
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s octree_file\n", argv[0]);
+        return 2;
+    }
+    octree_file file(argv[1]);
+    const uint32_t sizes[][2] = {{33,17}, {17,33}, {31,31}, {64,48}, {65,49}, {7,3}};
+    const glm::dvec3 positions[] = {glm::dvec3(0,0,-2.5), glm::dvec3(0.2,0.1,-1.5)};
+    int failures = 0;
+    for (auto & size : sizes) {
+        for (auto & position : positions) {
+            surface direct(size[0], size[1], true);
+            octree_set_threads(1);
+            octree_set_deferred(false);
+            render(&file, direct, position);
+            
+            surface deferred(size[0], size[1], true);
+            octree_set_threads(2);
+            octree_set_deferred(true);
+            render(&file, deferred, position);
+            
+            uint64_t pixels = size[0] * size[1];
+            if (memcmp(direct.data, deferred.data, pixels * 4) || memcmp(direct.depth, deferred.depth, pixels * 4)) {
+                fprintf(stderr, "Deferred rendering differs at %ux%u.\n", size[0], size[1]);
+                failures++;
+            }
+        }
+    }
+    return failures ? 1 : 0;
+}
+
+// kate: space-indent on; indent-width 4; mixedindent off; indent-mode cstyle; 
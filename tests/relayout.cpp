@@ -0,0 +1,112 @@
+/*
+    Voxel-Engine - A CPU based sparse octree renderer.
+    Copyright (C) 2015  B.J. Conijn <bcmpinc@users.sourceforge.net>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+#include "octree.h"
+
+/** Checks that octree_relayout preserves the octree, and that none of its nodes straddle a page of memory, 
+ * for both the OC2 format and the wide format, whose node array starts after the header. */
+
+static uint32_t seed = 1;
+/** Returns a pseudo random number. */
+static uint32_t next_random() {
+  seed = seed * 1103515245 + 12345;
+  return seed >> 16;
+}
+
+/** Appends a random subtree of the given depth to the node array and returns the position of its root. */
+template<class child_t>
+static child_t generate(std::vector<child_t> & nodes, int depth) {
+  typedef basic_octree<child_t> octree_node;
+  uint32_t bitmask = next_random() & 0xff;
+  if (bitmask == 0) bitmask = 1;
+  child_t pos = nodes.size();
+  nodes.resize(pos + 1 + popcount(bitmask));
+  std::vector<child_t> child;
+  for (int i = 0; i < popcount(bitmask); i++) {
+    child.push_back(depth == 0 ? octree_node::COLOR | next_random() : generate(nodes, depth - 1));
+  }
+  octree_node & node = *reinterpret_cast<octree_node *>(&nodes[pos]);
+  node.avgcolor = next_random();
+  node.bitmask = bitmask;
+  std::copy(child.begin(), child.end(), node.child);
+  return pos;
+}
+
+/** Checks whether the subtrees at the given positions of both octrees are identical. */
+template<class child_t>
+static bool same_subtree(const basic_octree<child_t> * a, child_t i, const basic_octree<child_t> * b, child_t j) {
+  if (a[i].avgcolor != b[j].avgcolor || a[i].bitmask != b[j].bitmask) return false;
+  for (uint32_t k = 0; k < a[i].size(); k++) {
+    if (a[i].is_pointer(k) != b[j].is_pointer(k)) return false;
+    if (a[i].is_pointer(k) ? !same_subtree(a, a[i].child[k], b, b[j].child[k]) : a[i].child[k] != b[j].child[k]) return false;
+  }
+  return true;
+}
+
+/** Counts the nodes of the subtree at the given position that do not lie within a single page of the file. */
+template<class child_t>
+static int count_straddling(const basic_octree<child_t> * root, child_t i, uint64_t header) {
+  uint64_t begin = header + i * sizeof(child_t);
+  uint64_t end = begin + (1 + root[i].size()) * sizeof(child_t);
+  int count = begin / OCTREE_PAGE_SIZE != (end - 1) / OCTREE_PAGE_SIZE;
+  for (uint32_t k = 0; k < root[i].size(); k++) {
+    if (root[i].is_pointer(k)) count += count_straddling(root, root[i].child[k], header);
+  }
+  return count;
+}
+
+/** Relayouts a random octree in the given format and checks the result. 
+ * @return the number of failed checks. */
+template<class child_t>
+static int check(octree_format format) {
+  typedef basic_octree<child_t> octree_node;
+  std::vector<child_t> nodes;
+  generate(nodes, 5);
+  {
+    octree_file in("test_relayout_in.oc2", nodes.size() * sizeof(child_t), format);
+    std::copy(nodes.begin(), nodes.end(), in.nodes<child_t>());
+  }
+  octree_file in("test_relayout_in.oc2");
+  octree_relayout(&in, "test_relayout_out.oc2");
+  octree_file out("test_relayout_out.oc2");
+  
+  int failures = 0;
+  if (!same_subtree(in.nodes<octree_node>(), child_t(0), out.nodes<octree_node>(), child_t(0))) {
+    fprintf(stderr, "Relayouted octree in format %d differs from its input.\n", format);
+    failures++;
+  }
+  int straddling = count_straddling(out.nodes<octree_node>(), child_t(0), octree_file::header_size(format));
+  if (straddling) {
+    fprintf(stderr, "%d nodes of the relayouted octree in format %d straddle a page boundary.\n", straddling, format);
+    failures++;
+  }
+  remove("test_relayout_in.oc2");
+  remove("test_relayout_out.oc2");
+  return failures;
+}
+
+int main() {
+  int failures = check<uint32_t>(OCTREE_FORMAT_OC2) + check<uint64_t>(OCTREE_FORMAT_WIDE);
+  return failures ? 1 : 0;
+}
+
+// kate: space-indent on; indent-width 2; mixedindent off; indent-mode cstyle; 